@@ -17,20 +17,72 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h> // Para malloc()
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>      // Para status message
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define MVI_VERSION "0.0.1"
+// Default tab stop, it can be changed with :set ts=N
 #define MVI_TAB_STOP 8
+// Control characters are drawn as ^X
+#define IS_CTRL_BYTE(c) ((unsigned char)(c) < 0x20 || (c) == 0x7f)
+// Letters, digits and _ make up the words that are completed
+#define IS_WORD_CHAR(c) (isalnum((unsigned char)(c)) || (c) == '_')
+// Longer runs of word characters are not put in the word index
+#define MVI_WORD_MAX 64
+// Completions offered by frequency, and rows around the cursor searched for
+// words close to it
+#define MVI_COMPLETE_MAX 32
+#define MVI_COMPLETE_WINDOW 100
+// Milliseconds of each slice of background indexing
+#define MVI_WORDS_SLICE_MS 20
 // Amount of quit presses to force quit without saving
 #define MVI_QUIT_TIMES 1
+// Rows around the viewport and the cursor that are never paged out
+#define MVI_PAGE_MARGIN 64
+// Size of the chunks used to scan and write files in bounded-memory mode
+#define MVI_IO_CHUNK (1 << 20)
+// Identifies the line-index cache files and their format
+#define MVI_INDEX_MAGIC "MVIIDX2"
+// Identifies the first message a client sends to the server
+#define MVI_SERVER_MAGIC "MVISRV1"
+// Bytes on each line of the hex view
+#define MVI_HEX_WIDTH 16
+// Bytes at the start of a file searched for NUL to tell binary files apart
+#define MVI_HEX_SNIFF 65536
+// Bytes of the file the hex view reads at a time
+#define MVI_HEX_WINDOW 65536
+// Edits after which the diff stops looking for the shortest script
+#define MVI_DIFF_MAX_D 8192
+// Minimum amount of rows given to each thread by parallel commands
+#define MVI_PARALLEL_MIN 16384
+// Size of the slabs the text of short rows is carved from
+#define MVI_SLAB_SIZE (1 << 20)
+// Number of block sizes served from the slabs, bigger blocks use malloc
+#define MVI_TEXT_CLASSES 14
+#define MVI_TEXT_MALLOC 0xff
+// Rows and registers that can share one block of text
+#define MVI_TEXT_REFS_MAX 0xffffff
 // Define the control key plus q to quit the operation
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -54,15 +106,217 @@ enum editorKey {
   MODE_INSERT
 };
 
+// Flags of an erow, used by the bounded-memory mode
+enum erowFlags {
+  // The row differs from its copy in the source file
+  ROW_MODIFIED = 1,
+  // The current contents of the row are stored in the spill file
+  ROW_SPILLED = 2,
+  // The row was used since the last eviction sweep (second chance)
+  ROW_REF = 4,
+  // The words of the row are counted in the word index
+  ROW_WORDS = 8,
+  // The render was expanded after chars, otherwise chars is the render
+  ROW_EXPANDED = 16
+};
+
 // Datatype for storing row of text in our editor
 // We use typedef to write a little less everytime we want to use erow
+// When chars is NULL the row is paged out and its text lives at off in the
+// source file, or in the spill file if it was modified.
+// chars and the render share one block of text storage, see editorRowRender
 typedef struct erow {
   int size;
   int rsize;
   char *chars;
-  char *render;
+  off_t off;
+  // Bytes of chars and render charged to the memory budget
+  int cost;
+  int flags;
 } erow;
 
+// Rows that were replaced by a change: at is where the n new rows start and
+// rows holds the oldn old ones
+typedef struct undoSpan {
+  int at;
+  int n;
+  int oldn;
+  erow *rows;
+} undoSpan;
+
+// The last bulk change, it can be undone while the buffer isn't edited again
+struct undoRecord {
+  undoSpan *spans;
+  int nspans, cap;
+  // Old rows of a change made of many one-row spans, kept in one array the
+  // spans point into instead of one array each
+  erow *rows;
+  int dirty;
+};
+
+// Header in front of each block of row text. Rows and registers holding the
+// same text share the block, refs counts them
+typedef struct textHeader {
+  uint32_t cap;
+  uint32_t cls : 8;
+  uint32_t refs : 24;
+} textHeader;
+
+// Slab allocator for the text of the rows. Blocks of a few sizes are carved
+// out of big slabs and recycled through one free list per size. The slabs are
+// released all at once when the buffer is closed
+struct textArena {
+  // Slabs linked through their first bytes, and free space in the last one
+  char *slabs;
+  char *cur;
+  char *end;
+  void *freelist[MVI_TEXT_CLASSES];
+};
+
+// Lines a[astart, astart + alen) were replaced by b[bstart, bstart + blen)
+typedef struct diffHunk {
+  int astart, alen;
+  int bstart, blen;
+} diffHunk;
+
+// How a row differs from the file on disk in diff mode
+enum diffMark {
+  DIFF_ADDED = 1,
+  DIFF_CHANGED = 2,
+  // Lines of the file were removed below this row
+  DIFF_DELETED = 4
+};
+
+// Lines of a file mapped in memory
+struct lineIndex {
+  int fd;
+  char *map;
+  off_t size;
+  off_t *offs;
+  int *lens;
+  int n;
+};
+
+// Diff mode: marks of each row, first row of each hunk, and the state of the
+// buffer and the file they were computed for
+struct diffView {
+  int active;
+  unsigned char *marks;
+  int *hunks;
+  int nhunks;
+  int dirty;
+  int numrows;
+  struct stat st;
+  struct lineIndex disk;
+};
+
+// A byte changed in the hex view and not saved yet
+struct hexEdit {
+  off_t off;
+  unsigned char byte;
+};
+
+// Hex view of a binary file: the bytes are drawn from a window of the file
+// read with pread, the changed ones from a list sorted by offset. A mapping
+// of the file would fault when another program truncates it
+struct hexView {
+  int active;
+  // Show every file in hex, set by -x
+  int forced;
+  int fd;
+  off_t size;
+  unsigned char *window;
+  off_t winoff;
+  size_t winlen;
+  // Byte under the cursor, first line on the screen and if the cursor is on
+  // the low half of the byte
+  off_t cursor;
+  off_t top;
+  int nibble;
+  struct hexEdit *edits;
+  int nedits;
+  int editcap;
+};
+
+// Rows yanked or deleted into a register. They share their text with the rows
+// of the buffer, or point to their place on disk when they are paged out
+struct yankRegister {
+  erow *rows;
+  int n;
+};
+
+// Node of the word index: a trie of the words in the buffer. Each node knows
+// how many times its word appears and the highest count below it, so the most
+// frequent words for a prefix are found without visiting the others
+typedef struct wordNode {
+  int child;
+  int next;
+  int parent;
+  int count;
+  int best;
+  unsigned char c;
+} wordNode;
+
+// The word index and the rows it still has to read in the background
+struct wordIndex {
+  wordNode *nodes;
+  int nnodes;
+  int cap;
+  // Rows [stalelo, stalehi) may have words that are not counted, the
+  // background pass goes through them from stalelo
+  int stalelo;
+  int stalehi;
+};
+
+// Ctrl-N completion in progress: where the word starts, how much of it was
+// typed and how much was added, and the words offered
+struct completion {
+  int active;
+  int row;
+  int start;
+  int prefixlen;
+  int shown;
+  char **words;
+  int nwords;
+  int idx;
+};
+
+// Header of the line-index cache. It is followed by the path of the file,
+// padded to 8 bytes, and by the rows as they are laid out in E.row
+struct indexHeader {
+  char magic[8];
+  uint64_t size;
+  uint64_t mtime_sec;
+  uint64_t mtime_nsec;
+  uint64_t ino;
+  uint64_t dev;
+  uint64_t nlines;
+  // Longest line and lines with tabs or control characters
+  uint64_t maxlen;
+  uint64_t speciallines;
+  // Range of rows that would not be written back as they are, see
+  // editorDirtyInit
+  uint64_t dirtylo;
+  uint64_t dirtyhi;
+  uint64_t pathlen;
+};
+
+// First message of a client: the size of its terminal and the absolute path
+// of the file it edits, which follows the header
+struct clientHello {
+  char magic[8];
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t pathlen;
+};
+
+// Keys recorded in a register by q and replayed by @
+struct macro {
+  int *keys;
+  int len;
+  int cap;
+};
+
 // Struct which will contain the state/config of the editor
 struct editorConfig {
   // Cursor positions
@@ -76,13 +330,77 @@ struct editorConfig {
   int screenrows;
   int screencols;
   int numrows;
+  int rowcap;
   erow *row;
+  // Rows taken from the line-index cache live in a private mapping of it,
+  // which starts at rowmap
+  char *rowmap;
+  size_t rowmaplen;
+  struct textArena arena;
   // Flag to check whether the file has been modified
   int dirty;
+  // Rows [dirtylo, dirtyhi) may differ from the file on disk, the rows after
+  // them are unchanged but may have moved
+  int dirtylo;
+  int dirtyhi;
   char *filename;
   char statusmsg[80];
   time_t statusmsg_time;
   int mode;
+  // Bounded-memory mode: budget for row text (0 = unlimited) and bytes in use
+  size_t memlimit;
+  size_t rowbytes;
+  // Source file the paged-out rows are read from, and scratch file for
+  // modified rows that were paged out
+  int srcfd;
+  int spillfd;
+  // Keep a cache of the line offsets next to the file
+  int indexcache;
+  // Serving a client of the server, the terminal is at the end of a socket.
+  // The sessions of the same file count themselves in memory they share
+  int session;
+  int *sessions;
+  off_t spilllen;
+  // Position of the clock hand of the eviction sweep
+  int clock;
+  // Follow mode: inotify watch on the file, offset up to where it was read
+  // and whether the last row is a line still being written. That row starts
+  // at followoff and its bytes end at followpartend
+  int follow;
+  int inotifyfd;
+  int followwd;
+  int followfd;
+  off_t followoff;
+  off_t followpartend;
+  int followpartial;
+  // Identity of the file on disk when it was last read or written, used to
+  // notice when another program changes it
+  struct stat filestat;
+  int diskchanged;
+  struct undoRecord undo;
+  struct diffView diff;
+  struct hexView hex;
+  struct wordIndex words;
+  struct completion complete;
+  // Count typed before a normal mode command
+  int count;
+  int tabstop;
+  // Register being recorded (-1 when not recording) and the macro registers
+  int recording;
+  struct macro macros[26];
+  // Yank registers a-z and the unnamed one after them, and the register
+  // chosen with " for the next command (-1 for the unnamed one)
+  struct yankRegister yanks[27];
+  int yankreg;
+  // Keys being replayed, the screen isn't drawn until the replay ends
+  int replaying;
+  int *replaykeys;
+  int replaylen;
+  int replaypos;
+  // Bytes typed while a filter ran, read before the terminal
+  char *typeahead;
+  size_t typeaheadlen;
+  size_t typeaheadpos;
   struct termios orig_termios;
 };
 
@@ -92,6 +410,16 @@ struct editorConfig E;
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorRowLoad(erow *row);
+void editorOpen(char *filename);
+void editorWordsRemove(erow *row);
+void editorWordsStale(int at, int del, int n);
+void editorInsertChar(int c);
+void editorDelChar();
+int pwriteAll(int fd, const char *buf, size_t len, off_t off);
+void editorFollowSync();
+void editorIdle();
+void editorProcessKeypress();
 
 // Prints an error message and exits the program and clears the screen
 void die(const char *s) {
@@ -134,24 +462,38 @@ void enableRawMode() {
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 }
 
-// Waits for keypresses and returns them
-int editorReadKey() {
+// Reads a byte of input, the bytes typed while a filter ran come first
+ssize_t editorReadInput(char *c) {
+  if (E.typeaheadpos < E.typeaheadlen) {
+    *c = E.typeahead[E.typeaheadpos++];
+    if (E.typeaheadpos == E.typeaheadlen) E.typeaheadpos = E.typeaheadlen = 0;
+    return 1;
+  }
+  return read(STDIN_FILENO, c, 1);
+}
+
+// Waits for keypresses from the terminal and returns them
+int editorReadTerminalKey() {
   int nread;
   char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
+  while ((nread = editorReadInput(&c)) != 1) {
     if (nread == -1 && errno != EAGAIN) die("read");
+    // The client of the server went away
+    if (nread == 0 && E.session) exit(0);
+    // read() timed out without a key, do the background work
+    if (nread == 0 || (nread == -1 && E.session)) editorIdle();
   }
 
   // Check if key pressed had an escape sequence
   if (c == '\x1b') {
     char seq[3];
 
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+    if (editorReadInput(&seq[0]) != 1) return '\x1b';
+    if (editorReadInput(&seq[1]) != 1) return '\x1b';
 
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+        if (editorReadInput(&seq[2]) != 1) return '\x1b';
         if (seq[2] == '~') {
           // Makes it possible to use page up and page down and also addes home key and end key
           switch (seq[1]) {
@@ -188,6 +530,65 @@ int editorReadKey() {
   }
 }
 
+/*** macros ***/
+
+// Returns the next key, from the macro being replayed or from the terminal.
+// Keys from the terminal are recorded while a macro is being recorded
+int editorReadKey() {
+  if (E.replaying) {
+    // A command waiting for more keys than the macro has is cancelled
+    if (E.replaypos == E.replaylen) return '\x1b';
+    return E.replaykeys[E.replaypos++];
+  }
+
+  int c = editorReadTerminalKey();
+  if (E.recording != -1) {
+    struct macro *m = &E.macros[E.recording];
+    if (m->len == m->cap) {
+      m->cap = m->cap ? m->cap * 2 : 64;
+      m->keys = realloc(m->keys, sizeof(int) * m->cap);
+    }
+    m->keys[m->len++] = c;
+  }
+  return c;
+}
+
+// Starts recording the keys into register a-z, or stops the recording
+void editorMacroRecord() {
+  if (E.recording != -1) {
+    // Drops the q that stopped the recording
+    E.macros[E.recording].len--;
+    E.recording = -1;
+    return;
+  }
+  int reg = editorReadKey();
+  if (reg < 'a' || reg > 'z') return;
+  E.recording = reg - 'a';
+  E.macros[E.recording].len = 0;
+}
+
+// Runs the keys of a register times times. Nothing is drawn until the end, so
+// the speed only depends on the edits
+void editorMacroReplay(int times) {
+  int reg = editorReadKey();
+  if (E.replaying || reg < 'a' || reg > 'z') return;
+
+  struct macro *m = &E.macros[reg - 'a'];
+  if (m->len == 0) {
+    editorSetStatusMessage("Register %c is empty", reg);
+    return;
+  }
+  // The register can't change while replaying, q is ignored
+  E.replaying = 1;
+  E.replaykeys = m->keys;
+  E.replaylen = m->len;
+  while (times--) {
+    E.replaypos = 0;
+    while (E.replaypos < E.replaylen) editorProcessKeypress();
+  }
+  E.replaying = 0;
+}
+
 // Used to get the cursor position in case which we will use to get the terminal window screen size
 int getCursorPosition(int *rows, int *cols) {
   char buf[32];
@@ -222,15 +623,26 @@ int getWindowSize(int *rows, int *cols) {
   }
 }
 
+// Text of a row as it is shown. Rows with tabs or control characters have
+// it right after the null byte of chars, the others are shown as they are
+static inline char *editorRowRender(erow *row) {
+  return row->flags & ROW_EXPANDED ? row->chars + row->size + 1 : row->chars;
+}
+
 // Calculate row x (E.rx)
 // Converts index from cx (cursor) to rx (row). Loops through all characters at cx 
-// and computes the space of each tab
+// and computes the space of each tab and control character. Rows without them
+// render as they are
 int editorRowCxToRx(erow *row, int cx) {
   int rx = 0;
   int j;
+  editorRowLoad(row);
+  if (!(row->flags & ROW_EXPANDED)) return cx;
   for (j = 0; j < cx; j++) {
     if (row->chars[j] == '\t')
-      rx += (MVI_TAB_STOP - 1) - (rx % MVI_TAB_STOP);
+      rx += (E.tabstop - 1) - (rx % E.tabstop);
+    else if (IS_CTRL_BYTE(row->chars[j]))
+      rx++;
     rx++;
   }
   return rx;
@@ -241,319 +653,3698 @@ int editorRowCxToRx(erow *row, int cx) {
 int editorRowRxToCx(erow *row, int rx) {
   int cur_rx = 0;
   int cx;
+  editorRowLoad(row);
+  if (!(row->flags & ROW_EXPANDED)) return rx < row->size ? rx : row->size;
   for (cx = 0; cx < row->size; cx++) {
     if (row->chars[cx] == '\t')
-      cur_rx += (MVI_TAB_STOP - 1) - (cur_rx % MVI_TAB_STOP);
+      cur_rx += (E.tabstop - 1) - (cur_rx % E.tabstop);
+    else if (IS_CTRL_BYTE(row->chars[cx]))
+      cur_rx++;
     cur_rx++;
     if (cur_rx > rx) return cx;
   }
   return cx;
 }
 
-// Uses chars from a string in a erow to fill the render string
-// Loops through all row characters and counts the tabs to compute the size
-// (Each tab is 8 chars)
-// Then, if the char is a tab it add spaces until tab's stop (a constant)
-void editorUpdateRow(erow *row) {
-  int tabs = 0;
-  int j;
-  for (j = 0; j < row->size; j++)
-    if (row->chars[j] == '\t') tabs++;
+/*** row storage ***/
+
+// Sizes of the blocks served from the slabs, header included
+static const uint32_t textClasses[MVI_TEXT_CLASSES] = {
+  16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
 
-  free(row->render);
-  row->render = malloc(row->size + tabs*(MVI_TAB_STOP - 1) + 1);
+// Allocates a block of text with malloc. Safe to call from any thread
+char *editorTextMalloc(size_t need) {
+  textHeader *h = malloc(sizeof(textHeader) + need);
+  if (h == NULL) die("malloc");
+  h->cap = need;
+  h->cls = MVI_TEXT_MALLOC;
+  h->refs = 1;
+  return (char *)(h + 1);
+}
+
+// Allocates a block for at least need bytes of text, short ones come from the
+// slabs
+char *editorTextAlloc(size_t need) {
+  struct textArena *a = &E.arena;
+  uint32_t cls = 0;
+  while (cls < MVI_TEXT_CLASSES &&
+         textClasses[cls] - sizeof(textHeader) < need) cls++;
+  if (cls == MVI_TEXT_CLASSES) return editorTextMalloc(need);
+
+  textHeader *h = a->freelist[cls];
+  if (h) {
+    a->freelist[cls] = *(void **)(h + 1);
+  } else {
+    if (a->end - a->cur < (long)textClasses[cls]) {
+      char *slab = malloc(MVI_SLAB_SIZE);
+      if (slab == NULL) die("malloc");
+      *(char **)slab = a->slabs;
+      a->slabs = slab;
+      // Keeps the blocks aligned after the link to the next slab
+      a->cur = slab + 16;
+      a->end = slab + MVI_SLAB_SIZE;
+    }
+    h = (textHeader *)a->cur;
+    a->cur += textClasses[cls];
+  }
+  h->cap = textClasses[cls] - sizeof(textHeader);
+  h->cls = cls;
+  h->refs = 1;
+  return (char *)(h + 1);
+}
+
+// Drops one reference to a block, the last one returns it to its free list
+// or to malloc
+void editorTextFree(char *text) {
+  textHeader *h = (textHeader *)text - 1;
+  if (--h->refs > 0) return;
+  if (h->cls == MVI_TEXT_MALLOC) {
+    free(h);
+  } else {
+    *(void **)text = E.arena.freelist[h->cls];
+    E.arena.freelist[h->cls] = h;
+  }
+}
+
+size_t editorTextCap(char *text) {
+  return ((textHeader *)text - 1)->cap;
+}
+
+// Takes one more reference to a block. A block shared too many times is
+// copied instead
+char *editorTextShare(char *text) {
+  textHeader *h = (textHeader *)text - 1;
+  if (h->refs < MVI_TEXT_REFS_MAX) {
+    h->refs++;
+    return text;
+  }
+  char *copy = editorTextAlloc(h->cap);
+  memcpy(copy, text, h->cap);
+  return copy;
+}
+
+// Gives a row a block of its own, with its text and render
+void editorRowUnshare(erow *row) {
+  char *old = row->chars;
+  if (((textHeader *)old - 1)->refs == 1) return;
+  size_t cap = editorTextCap(old);
+  row->chars = editorTextAlloc(cap);
+  memcpy(row->chars, old, cap);
+  editorTextFree(old);
+}
+
+// Frees every slab at once
+void editorArenaRelease() {
+  char *slab = E.arena.slabs;
+  while (slab) {
+    char *next = *(char **)slab;
+    free(slab);
+    slab = next;
+  }
+  memset(&E.arena, 0, sizeof(E.arena));
+}
+
+// Makes sure the block of a row has room for need bytes, moving chars to a
+// bigger block if needed
+void editorRowReserve(erow *row, size_t need) {
+  if (row->chars && editorTextCap(row->chars) >= need) return;
+  if (row->chars == NULL) {
+    row->chars = editorTextAlloc(need);
+    return;
+  }
+  char *text = editorTextAlloc(need);
+  memcpy(text, row->chars, row->size + 1);
+  editorTextFree(row->chars);
+  row->chars = text;
+}
+
+// Frees E.row, or unmaps it when it came from the line-index cache
+void editorRowsFree() {
+  if (E.rowmap) munmap(E.rowmap, E.rowmaplen);
+  else free(E.row);
+  E.row = NULL;
+  E.rowmap = NULL;
+  E.rowmaplen = 0;
+  E.rowcap = 0;
+}
+
+// Makes room in E.row for n rows, doubling its size
+void editorRowsReserve(int n) {
+  if (n <= E.rowcap) return;
+  int cap = E.rowcap ? E.rowcap * 2 : 64;
+  if (cap < n) cap = n;
+  if (E.rowmap) {
+    // Mapped rows move to the heap once they outgrow the mapping
+    erow *rows = malloc(sizeof(erow) * cap);
+    if (rows == NULL) die("malloc");
+    memcpy(rows, E.row, sizeof(erow) * E.numrows);
+    editorRowsFree();
+    E.row = rows;
+  } else {
+    E.row = realloc(E.row, sizeof(erow) * cap);
+    if (E.row == NULL) die("realloc");
+  }
+  E.rowcap = cap;
+}
 
-  int idx = 0;
-  for (j = 0; j < row->size; j++) {
-    if (row->chars[j] == '\t') {
-      row->render[idx++] = ' ';
-      while (idx % MVI_TAB_STOP != 0) row->render[idx++] = ' ';
+/*** render ***/
+
+// Returns the position of the first tab or control character from start, or
+// len if there is none. Looks at 16 bytes at a time when SSE2 is available
+static inline int editorFindSpecial(const char *s, int start, int len) {
+  int j = start;
+#ifdef __SSE2__
+  const __m128i limit = _mm_set1_epi8(0x1f);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  for (; j + 16 <= len; j += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+    // Unsigned v <= 0x1f is the same as min(v, 0x1f) == v
+    __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(v, limit), v);
+    int mask = _mm_movemask_epi8(_mm_or_si128(ctrl, _mm_cmpeq_epi8(v, del)));
+    if (mask) return j + __builtin_ctz(mask);
+  }
+#endif
+  for (; j < len; j++)
+    if (IS_CTRL_BYTE(s[j])) return j;
+  return len;
+}
+
+// Expands a row that has tabs or control characters, starting at the first of
+// them. Plain runs are copied in bulk and tabs are filled from a string of
+// spaces. When it is given a constant ts the compiler turns the modulo into a
+// mask, see editorUpdateRow
+static inline void editorRenderSpecial(erow *row, int first, int ts) {
+  static const char spaces[] = "                                ";
+  const char *s = row->chars;
+  int j, col;
+
+  // First pass: width of the row, jumping from one special byte to the next
+  col = first;
+  for (j = first; j < row->size; ) {
+    if (s[j] == '\t') col += ts - col % ts;
+    else col += 2;
+    int next = editorFindSpecial(s, j + 1, row->size);
+    col += next - j - 1;
+    j = next;
+  }
+
+  // The render goes in the same block, after chars
+  editorRowReserve(row, row->size + 1 + col + 1);
+  s = row->chars;
+  char *r = row->chars + row->size + 1;
+  row->flags |= ROW_EXPANDED;
+  memcpy(r, s, first);
+
+  // Second pass: fills the render
+  col = first;
+  for (j = first; j < row->size; ) {
+    if (s[j] == '\t') {
+      int width = ts - col % ts;
+      int left = width;
+      while (left > 0) {
+        int n = left < (int)sizeof(spaces) - 1 ? left : (int)sizeof(spaces) - 1;
+        memcpy(r + col, spaces, n);
+        col += n;
+        left -= n;
+      }
     } else {
-      row->render[idx++] = row->chars[j];
+      r[col++] = '^';
+      r[col++] = s[j] == 0x7f ? '?' : s[j] | 0x40;
     }
+    int next = editorFindSpecial(s, j + 1, row->size);
+    memcpy(r + col, s + j + 1, next - j - 1);
+    col += next - j - 1;
+    j = next;
+  }
+  r[col] = '\0';
+  row->rsize = col;
+}
+
+// Uses chars from a string in a erow to fill the render string.
+// Rows without tabs or control characters (most of them) use chars as their
+// render. The others are expanded, with tab stops 4 and 8 specialized
+void editorUpdateRow(erow *row) {
+  int first = editorFindSpecial(row->chars, 0, row->size);
+  if (first == row->size) {
+    editorRowReserve(row, row->size + 1);
+    row->flags &= ~ROW_EXPANDED;
+    row->rsize = row->size;
+  } else if (E.tabstop == 8) {
+    editorRenderSpecial(row, first, 8);
+  } else if (E.tabstop == 4) {
+    editorRenderSpecial(row, first, 4);
+  } else {
+    editorRenderSpecial(row, first, E.tabstop);
+  }
+
+  // Charges the new size of the block to the memory budget
+  int cap = editorTextCap(row->chars);
+  E.rowbytes += cap - row->cost;
+  row->cost = cap;
+}
+
+// Records that del rows at at were replaced by n rows, widening the range of
+// rows that must be written on the next save
+void editorDirtyRows(int at, int del, int n) {
+  // The changed rows are indexed again in the background
+  editorWordsStale(at, del, n);
+  if (E.dirtylo == INT_MAX) {
+    E.dirtylo = at;
+    E.dirtyhi = at + n;
+    return;
   }
-  row->render[idx] = '\0';
-  row->rsize = idx;
+  if (E.dirtyhi >= at + del) E.dirtyhi += n - del;
+  else if (E.dirtyhi > at) E.dirtyhi = at;
+  if (E.dirtylo > at) E.dirtylo = at;
+  if (E.dirtyhi < at + n) E.dirtyhi = at + n;
+}
+
+// Fills a new row with a copy of the string
+void editorRowInit(erow *row, char *s, size_t len) {
+  row->size = len;
+  // The render only needs room of its own when the row has tabs or control
+  // characters, editorUpdateRow makes it then
+  row->chars = editorTextAlloc(len + 1);
+  memcpy(row->chars, s, len);
+  row->chars[len] = '\0';
+
+  row->rsize = 0;
+  row->off = -1;
+  row->cost = 0;
+  row->flags = ROW_MODIFIED | ROW_REF;
+  editorUpdateRow(row);
 }
 
 // Creates space for a new row and copies the string at the end.
-// Multiplies the bits to perform a realloc
 void editorInsertRow(int at, char *s, size_t len) {
   if (at < 0 || at > E.numrows) return;
-  E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
+  editorRowsReserve(E.numrows + 1);
   memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
 
-  E.row[at].size = len;
-  E.row[at].chars = malloc(len + 1);
-  memcpy(E.row[at].chars, s, len);
-  E.row[at].chars[len] = '\0';
-
-  E.row[at].rsize = 0;
-  E.row[at].render = NULL;
-  editorUpdateRow(&E.row[at]);
+  editorRowInit(&E.row[at], s, len);
 
   E.numrows++;
   E.dirty++;
+  editorDirtyRows(at, 0, 1);
 }
 
 // Frees up the memory of a given row
 void editorFreeRow(erow *row) {
-  free(row->render);
-  free(row->chars);
+  if (row->chars) editorTextFree(row->chars);
+  E.rowbytes -= row->cost;
+  row->cost = 0;
 }
 
-void editorDelRow(int at) {
-  if (at < 0 || at >= E.numrows) return;
-  editorFreeRow(&E.row[at]);
-  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-  E.numrows--;
-  E.dirty++;
+/*** paging ***/
+
+// Marks a row as different from the source file, so it must be written to the
+// spill file again before it can be paged out
+// Rows that share their text are given a copy here, before it is written, so
+// this is the write barrier of the registers too. The render lives in the same
+// block, but every row sharing it renders the same text the same way
+void editorRowTouch(erow *row) {
+  editorWordsRemove(row);
+  if (row->chars) editorRowUnshare(row);
+  row->flags = (row->flags | ROW_MODIFIED) & ~ROW_SPILLED;
+  editorDirtyRows(row - E.row, 1, 1);
 }
 
-// Inserts a character into an erow at a given position
-void editorRowInsertChar(erow *row, int at, int c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  // memmove is like memcpy, but safe to use when source and destination overlaps
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
-  E.dirty++;
+// Creates the (unlinked) scratch file that receives modified rows paged out
+int editorSpillFd() {
+  if (E.spillfd == -1) {
+    const char *dir = getenv("TMPDIR");
+    char path[256];
+    snprintf(path, sizeof(path), "%s/mini-vi-spill-XXXXXX", dir ? dir : "/tmp");
+    E.spillfd = mkstemp(path);
+    if (E.spillfd == -1) die("mkstemp");
+    unlink(path);
+    E.spilllen = 0;
+  }
+  return E.spillfd;
 }
 
-// Inserts new line at start or middle of row
-void editorInsertNewline() {
-  // At start just adds a new row
-  if (E.cx == 0) {
-    editorInsertRow(E.cy, "", 0);
-  } else {
-    // Breaks the row at cursor position
-    erow *row = &E.row[E.cy];
-    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-    row = &E.row[E.cy];
-    row->size = E.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+// Copies the text of a paged out row from its backing file into dst
+void editorRowRead(erow *row, char *dst) {
+  int fd = (row->flags & ROW_SPILLED) ? E.spillfd : E.srcfd;
+  ssize_t done = 0;
+  while (done < row->size) {
+    ssize_t n = pread(fd, dst + done, row->size - done, row->off + done);
+    if (n <= 0) die("pread");
+    done += n;
   }
-  E.cy++;
-  E.cx = 0;
 }
 
-// Appends a row to the row before it (also modifying the size)
-void editorRowAppendString(erow *row, char *s, size_t len) {
-  row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
-  row->size += len;
+// Pages a row out of memory. Rows that only exist in memory are appended to
+// the spill file first
+void editorRowEvict(erow *row) {
+  if (row->chars == NULL) return;
+  if ((row->flags & ROW_MODIFIED) && !(row->flags & ROW_SPILLED)) {
+    int fd = editorSpillFd();
+    ssize_t done = 0;
+    while (done < row->size) {
+      ssize_t n = pwrite(fd, row->chars + done, row->size - done,
+                         E.spilllen + done);
+      if (n <= 0) die("pwrite");
+      done += n;
+    }
+    row->off = E.spilllen;
+    E.spilllen += row->size;
+    row->flags |= ROW_SPILLED;
+  }
+  editorFreeRow(row);
+  row->chars = NULL;
+  row->flags &= ~ROW_EXPANDED;
+}
+
+// Rows that are visible or close to the cursor always stay in memory
+int editorRowIsPinned(int at) {
+  if (at >= E.rowoff - MVI_PAGE_MARGIN &&
+      at < E.rowoff + E.screenrows + MVI_PAGE_MARGIN) return 1;
+  if (at >= E.cy - MVI_PAGE_MARGIN && at <= E.cy + MVI_PAGE_MARGIN) return 1;
+  return 0;
+}
+
+// Sweeps the rows like a clock, giving a second chance to recently used rows,
+// until the text in memory fits inside the budget again
+void editorEnforceMemoryLimit(erow *keep) {
+  if (E.memlimit == 0 || E.rowbytes <= E.memlimit) return;
+
+  // Evicts a bit more than needed so the sweep doesn't run on every load
+  size_t target = E.memlimit - E.memlimit / 8;
+  long scanned = 0;
+  while (E.rowbytes > target && scanned < 2L * E.numrows) {
+    if (E.clock >= E.numrows) E.clock = 0;
+    int at = E.clock++;
+    erow *row = &E.row[at];
+    scanned++;
+    if (row->chars == NULL || row == keep || editorRowIsPinned(at)) continue;
+    if (row->flags & ROW_REF) {
+      row->flags &= ~ROW_REF;
+      continue;
+    }
+    editorRowEvict(row);
+  }
+}
+
+// Makes sure the text of a row is in memory before it is used
+void editorRowLoad(erow *row) {
+  row->flags |= ROW_REF;
+  if (row->chars != NULL) return;
+
+  row->chars = editorTextAlloc(row->size + 1);
+  editorRowRead(row, row->chars);
   row->chars[row->size] = '\0';
+  row->rsize = 0;
   editorUpdateRow(row);
-  E.dirty++;
+  editorEnforceMemoryLimit(row);
 }
 
-// Deletes by moving the characters and overwriting the deleted char including the null byte at the end
-void editorRowDelChar(erow *row, int at) {
-  if (at < 0 || at >= row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  // Decrements row size and increment dirtiness
-  row->size--;
-  editorUpdateRow(row);
+// Replaces del rows starting at at with n new rows, moving the rows after them
+// only once
+void editorReplaceRows(int at, int del, erow *rows, int n) {
+  if (at < 0 || at + del > E.numrows) return;
+  int j;
+  for (j = at; j < at + del; j++) {
+    editorWordsRemove(&E.row[j]);
+    editorFreeRow(&E.row[j]);
+  }
+  editorRowsReserve(E.numrows - del + n);
+  memmove(&E.row[at + n], &E.row[at + del],
+          sizeof(erow) * (E.numrows - at - del));
+  memcpy(&E.row[at], rows, sizeof(erow) * n);
+  E.numrows += n - del;
   E.dirty++;
+  editorDirtyRows(at, del, n);
 }
 
-// Reads the character and calls editorRowInsertChar and passes cursor position
-void editorInsertChar(int c) {
-  if (E.cy == E.numrows) {
-    editorInsertRow(E.numrows, "", 0);
+/*** words ***/
+
+// Finds the child of a node for the next character of a word, adding it if
+// asked to. Returns -1 if there is none
+int editorWordChild(int node, unsigned char c, int add) {
+  struct wordIndex *wi = &E.words;
+  int child;
+  for (child = wi->nodes[node].child; child != -1; child = wi->nodes[child].next)
+    if (wi->nodes[child].c == c) return child;
+  if (!add) return -1;
+  if (wi->nnodes == wi->cap) {
+    wi->cap *= 2;
+    wi->nodes = realloc(wi->nodes, sizeof(wordNode) * wi->cap);
   }
-  editorRowInsertChar(&E.row[E.cy], E.cx, c);
-  E.cx++;
+  child = wi->nnodes++;
+  wordNode *n = &wi->nodes[child];
+  n->c = c;
+  n->child = -1;
+  n->count = 0;
+  n->best = 0;
+  n->parent = node;
+  n->next = wi->nodes[node].child;
+  wi->nodes[node].child = child;
+  return child;
 }
 
-// Reads the at cursor position and deletes it if any and moves the cursor
-void editorDelChar() {
-  if (E.cy == E.numrows) return;
-  if (E.cx == 0 && E.cy == 0) return;
-
-  erow *row = &E.row[E.cy];
-  if (E.cx > 0) {
-    editorRowDelChar(row, E.cx - 1);
-    E.cx--;
-  } else {
-    E.cx = E.row[E.cy - 1].size;
-    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-    editorDelRow(E.cy);
-    E.cy--;
+// Node of a word, -1 if it was never seen
+int editorWordFind(const char *s, int len, int add) {
+  struct wordIndex *wi = &E.words;
+  if (wi->nnodes == 0) {
+    if (!add) return -1;
+    wi->cap = 4096;
+    wi->nodes = malloc(sizeof(wordNode) * wi->cap);
+    wi->nnodes = 1;
+    memset(wi->nodes, 0, sizeof(wordNode));
+    wi->nodes[0].child = wi->nodes[0].next = wi->nodes[0].parent = -1;
   }
+  int node = 0, j;
+  for (j = 0; j < len && node != -1; j++)
+    node = editorWordChild(node, s[j], add);
+  return node;
 }
 
-// Converts array for erow struct into a string
-char *editorRowsToString(int *buflen) {
-  int totlen = 0;
-  int j;
+// Adds delta to the count of a word, then fixes the highest counts above it
+// until one doesn't change
+void editorWordCount(const char *s, int len, int delta) {
+  int node = editorWordFind(s, len, delta > 0);
+  if (node == -1) return;
+  wordNode *nodes = E.words.nodes;
+  nodes[node].count += delta;
+  if (nodes[node].count < 0) nodes[node].count = 0;
+  while (node != -1) {
+    int best = nodes[node].count, child;
+    for (child = nodes[node].child; child != -1; child = nodes[child].next)
+      if (nodes[child].best > best) best = nodes[child].best;
+    if (best == nodes[node].best) break;
+    nodes[node].best = best;
+    node = nodes[node].parent;
+  }
+}
 
-  // Lengths of each erow + new line character
-  for (j = 0; j < E.numrows; j++)
-    totlen += E.row[j].size + 1;
-  
-  *buflen = totlen;
-  char *buf = malloc(totlen);
-  char *p = buf;
+// Counts (delta 1) or uncounts (delta -1) the words of a text
+void editorWordsScan(const char *s, int len, int delta) {
+  int j = 0;
+  while (j < len) {
+    while (j < len && !IS_WORD_CHAR(s[j])) j++;
+    int start = j;
+    while (j < len && IS_WORD_CHAR(s[j])) j++;
+    if (j > start && j - start <= MVI_WORD_MAX)
+      editorWordCount(s + start, j - start, delta);
+  }
+}
 
-  // Copy the contents of each row at the end of the buffer appending a new line
-  for (j = 0; j < E.numrows; j++) {
-    memcpy(p, E.row[j].chars, E.row[j].size);
-    p += E.row[j].size;
-    *p = '\n';
-    p++;
+// Counts or uncounts the words of a row. Rows paged out are read without
+// being paged in
+void editorWordsRow(erow *row, int delta) {
+  if (row->chars) {
+    editorWordsScan(row->chars, row->size, delta);
+    return;
   }
+  char *buf = malloc(row->size + 1);
+  editorRowRead(row, buf);
+  editorWordsScan(buf, row->size, delta);
+  free(buf);
+}
 
-  return buf;
+void editorWordsAdd(erow *row) {
+  if (row->flags & ROW_WORDS) return;
+  editorWordsRow(row, 1);
+  row->flags |= ROW_WORDS;
 }
 
-// Reads the disk (a file)
-void editorOpen(char *filename) {
-  free(E.filename);
-  E.filename = strdup(filename);
+// Called before the text of a row changes or the row goes away
+void editorWordsRemove(erow *row) {
+  if (!(row->flags & ROW_WORDS)) return;
+  editorWordsRow(row, -1);
+  row->flags &= ~ROW_WORDS;
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (!fp) die("fopen");
+// Forgets every word
+void editorWordsClear() {
+  free(E.words.nodes);
+  memset(&E.words, 0, sizeof(E.words));
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                           line[linelen - 1] == '\r'))
-      linelen--;
-    editorInsertRow(E.numrows, line, linelen);
+// Records that del rows at at were replaced by n rows whose words may not be
+// counted. The rows still to be indexed move along with the rows around them
+void editorWordsStale(int at, int del, int n) {
+  struct wordIndex *wi = &E.words;
+  if (wi->stalelo >= wi->stalehi) {
+    wi->stalelo = at;
+    wi->stalehi = at + n;
+    return;
   }
-  free(line);
-  fclose(fp);
-  E.dirty = 0;
+  if (wi->stalehi >= at + del) wi->stalehi += n - del;
+  else if (wi->stalehi > at) wi->stalehi = at;
+  if (wi->stalelo >= at + del) wi->stalelo += n - del;
+  else if (wi->stalelo > at) wi->stalelo = at;
+  if (wi->stalelo > at) wi->stalelo = at;
+  if (wi->stalehi < at + n) wi->stalehi = at + n;
 }
 
-// Saves the open file
-void editorSave() {
-  // When file has no name execute prompt to read user input
-  if (E.filename == NULL) {
-    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-    if (E.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+// Adds the rows that are not in the index yet, a slice of time at a time so
+// keys are never kept waiting. Runs of rows still in the source file are read
+// with one read
+void editorWordsIdle() {
+  struct wordIndex *wi = &E.words;
+  if (wi->stalehi > E.numrows) wi->stalehi = E.numrows;
+  if (wi->stalelo >= wi->stalehi) return;
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  char *buf = NULL;
+  int n = 0;
+  while (wi->stalelo < wi->stalehi) {
+    erow *row = &E.row[wi->stalelo];
+    if (row->flags & ROW_WORDS) {
+      wi->stalelo++;
+    } else if (row->chars || E.srcfd == -1 || (row->flags & ROW_SPILLED) ||
+               row->size >= MVI_IO_CHUNK) {
+      editorWordsAdd(row);
+      wi->stalelo++;
+      n++;
+    } else {
+      if (buf == NULL) buf = malloc(MVI_IO_CHUNK);
+      off_t base = row->off;
+      ssize_t got = pread(E.srcfd, buf, MVI_IO_CHUNK, base);
+      int first = wi->stalelo;
+      // The rows that lie in the chunk one after the other
+      while (got > 0 && wi->stalelo < wi->stalehi) {
+        row = &E.row[wi->stalelo];
+        if (row->chars || (row->flags & (ROW_SPILLED | ROW_WORDS)) ||
+            row->off < base || row->off + row->size > base + got) break;
+        editorWordsScan(buf + (row->off - base), row->size, 1);
+        row->flags |= ROW_WORDS;
+        wi->stalelo++;
+        n++;
+      }
+      // A short read, the row is read the usual way
+      if (wi->stalelo == first) editorWordsAdd(&E.row[wi->stalelo++]);
+    }
+    if (n >= 256) {
+      n = 0;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if ((now.tv_sec - start.tv_sec) * 1000 +
+          (now.tv_nsec - start.tv_nsec) / 1000000 >= MVI_WORDS_SLICE_MS) {
+        free(buf);
+        return;
+      }
     }
   }
-  
-  int len;
-  char *buf = editorRowsToString(&len);
+  free(buf);
+}
+
+// Writes the word of a node into s, which must have room for MVI_WORD_MAX + 1
+void editorWordSpell(int node, char *s) {
+  char rev[MVI_WORD_MAX];
+  int len = 0;
+  while (E.words.nodes[node].parent != -1 && len < MVI_WORD_MAX) {
+    rev[len++] = E.words.nodes[node].c;
+    node = E.words.nodes[node].parent;
+  }
+  int j;
+  for (j = 0; j < len; j++) s[j] = rev[len - 1 - j];
+  s[len] = '\0';
+}
+
+// Finds the most frequent words that start with a prefix, best first, other
+// than the prefix itself. The subtrees are visited by their highest count, so
+// the search stops after max words. Returns how many were found
+int editorWordsTop(const char *prefix, int len, int *out, int max) {
+  int root = editorWordFind(prefix, len, 0);
+  if (root == -1) return 0;
+  wordNode *nodes = E.words.nodes;
+
+  // Max-heap of nodes; a negative entry stands for the word that ends there
+  // rather than the subtree below it
+  int cap = 256, size = 0, found = 0;
+  int *heap = malloc(sizeof(int) * cap);
+  int *key = malloc(sizeof(int) * cap);
+#define HEAP_PUSH(id, k) do { \
+    if (size == cap) { \
+      cap *= 2; \
+      heap = realloc(heap, sizeof(int) * cap); \
+      key = realloc(key, sizeof(int) * cap); \
+    } \
+    int i_ = size++; \
+    while (i_ > 0 && key[(i_ - 1) / 2] < (k)) { \
+      heap[i_] = heap[(i_ - 1) / 2]; \
+      key[i_] = key[(i_ - 1) / 2]; \
+      i_ = (i_ - 1) / 2; \
+    } \
+    heap[i_] = (id); \
+    key[i_] = (k); \
+  } while (0)
+
+  if (nodes[root].best > 0) HEAP_PUSH(root, nodes[root].best);
+  while (size > 0 && found < max) {
+    int top = heap[0];
+    int lastid = heap[--size], lastkey = key[size], i = 0;
+    while (2 * i + 1 < size) {
+      int c = 2 * i + 1;
+      if (c + 1 < size && key[c + 1] > key[c]) c++;
+      if (key[c] <= lastkey) break;
+      heap[i] = heap[c];
+      key[i] = key[c];
+      i = c;
+    }
+    heap[i] = lastid;
+    key[i] = lastkey;
+
+    if (top < 0) {
+      out[found++] = -top - 1;
+      continue;
+    }
+    if (nodes[top].count > 0 && top != root)
+      HEAP_PUSH(-top - 1, nodes[top].count);
+    int child;
+    for (child = nodes[top].child; child != -1; child = nodes[child].next)
+      if (nodes[child].best > 0) HEAP_PUSH(child, nodes[child].best);
+  }
+#undef HEAP_PUSH
+  free(heap);
+  free(key);
+  return found;
+}
+
+// A word offered by completion, with its count and distance to the cursor
+struct completionWord {
+  char word[MVI_WORD_MAX + 1];
+  int count;
+  int dist;
+  double score;
+};
+
+int editorCompletionCmp(const void *a, const void *b) {
+  const struct completionWord *x = a, *y = b;
+  if (x->score != y->score) return x->score < y->score ? 1 : -1;
+  return strcmp(x->word, y->word);
+}
+
+// Adds a word to the list, or updates its distance to the cursor
+void editorCompletionAdd(struct completionWord *list, int *n, const char *s,
+                         int len, int count, int dist) {
+  int j;
+  for (j = 0; j < *n; j++) {
+    if ((int)strlen(list[j].word) == len && memcmp(list[j].word, s, len) == 0) {
+      if (dist < list[j].dist) list[j].dist = dist;
+      return;
+    }
+  }
+  if (*n == 2 * MVI_COMPLETE_MAX) return;
+  memcpy(list[*n].word, s, len);
+  list[*n].word[len] = '\0';
+  list[*n].count = count;
+  list[*n].dist = dist;
+  (*n)++;
+}
+
+void editorCompleteEnd() {
+  int j;
+  for (j = 0; j < E.complete.nwords; j++) free(E.complete.words[j]);
+  free(E.complete.words);
+  memset(&E.complete, 0, sizeof(E.complete));
+}
+
+// Collects the words that complete the word before the cursor: the most
+// frequent ones in the buffer and the ones in the rows around the cursor,
+// ranked by frequency and distance
+int editorCompleteStart() {
+  erow *row = &E.row[E.cy];
+  editorRowLoad(row);
+  int start = E.cx;
+  while (start > 0 && IS_WORD_CHAR(row->chars[start - 1])) start--;
+  int len = E.cx - start;
+  if (len > MVI_WORD_MAX) return 0;
+  char prefix[MVI_WORD_MAX + 1];
+  memcpy(prefix, row->chars + start, len);
+  prefix[len] = '\0';
+
+  // The rows around the cursor have the words just typed. The word being
+  // typed is not a completion, so the row of the cursor is left out of the
+  // index until it is indexed again in the background
+  int first = E.cy > MVI_COMPLETE_WINDOW ? E.cy - MVI_COMPLETE_WINDOW : 0;
+  int last = E.cy + MVI_COMPLETE_WINDOW < E.numrows ? E.cy + MVI_COMPLETE_WINDOW
+                                                    : E.numrows - 1;
+  int r, j;
+  editorWordsRemove(row);
+  editorWordsStale(E.cy, 1, 1);
+  for (r = first; r <= last; r++)
+    if (E.row[r].chars && r != E.cy) editorWordsAdd(&E.row[r]);
+
+  struct completionWord list[2 * MVI_COMPLETE_MAX];
+  int nodes[MVI_COMPLETE_MAX], n = 0;
+  int found = editorWordsTop(prefix, len, nodes, MVI_COMPLETE_MAX);
+  for (j = 0; j < found; j++) {
+    char word[MVI_WORD_MAX + 1];
+    editorWordSpell(nodes[j], word);
+    editorCompletionAdd(list, &n, word, strlen(word),
+                        E.words.nodes[nodes[j]].count, MVI_COMPLETE_WINDOW);
+  }
+  for (r = first; r <= last; r++) {
+    erow *near = &E.row[r];
+    if (near->chars == NULL) continue;
+    int dist = r > E.cy ? r - E.cy : E.cy - r;
+    for (j = 0; j < near->size;) {
+      while (j < near->size && !IS_WORD_CHAR(near->chars[j])) j++;
+      int ws = j;
+      while (j < near->size && IS_WORD_CHAR(near->chars[j])) j++;
+      if (r == E.cy && ws == start) continue;
+
+      if (j - ws > len && j - ws <= MVI_WORD_MAX &&
+          memcmp(near->chars + ws, prefix, len) == 0) {
+        int node = editorWordFind(near->chars + ws, j - ws, 0);
+        editorCompletionAdd(list, &n, near->chars + ws, j - ws,
+                            node != -1 ? E.words.nodes[node].count : 1, dist);
+      }
+    }
+  }
+  if (n == 0) return 0;
+  for (j = 0; j < n; j++)
+    list[j].score = (double)list[j].count / (1 + list[j].dist);
+  qsort(list, n, sizeof(list[0]), editorCompletionCmp);
+
+  E.complete.active = 1;
+  E.complete.row = E.cy;
+  E.complete.start = start;
+  E.complete.prefixlen = len;
+  E.complete.shown = 0;
+  E.complete.words = malloc(sizeof(char *) * n);
+  for (j = 0; j < n; j++) E.complete.words[j] = strdup(list[j].word);
+  E.complete.nwords = n;
+  E.complete.idx = n;
+  return 1;
+}
+
+// Ctrl-N and Ctrl-P in insert mode: replaces the word before the cursor with
+// the next or previous completion, going back to what was typed after the last
+void editorComplete(int dir) {
+  struct completion *cp = &E.complete;
+  if (E.cy >= E.numrows) return;
+  if (!cp->active || cp->row != E.cy ||
+      E.cx != cp->start + cp->prefixlen + cp->shown) {
+    editorCompleteEnd();
+    if (!editorCompleteStart()) {
+      editorSetStatusMessage("No completions");
+      return;
+    }
+  }
+  cp->idx = (cp->idx + dir + cp->nwords + 1) % (cp->nwords + 1);
+
+  int j;
+  for (j = 0; j < cp->shown; j++) editorDelChar();
+  cp->shown = 0;
+  if (cp->idx < cp->nwords) {
+    char *rest = cp->words[cp->idx] + cp->prefixlen;
+    for (j = 0; rest[j]; j++) editorInsertChar(rest[j]);
+    cp->shown = j;
+    editorSetStatusMessage("Completion %d of %d", cp->idx + 1, cp->nwords);
+  } else {
+    editorSetStatusMessage("Back at the original word");
+  }
+}
+
+/*** undo ***/
+
+// Forgets the last change
+void editorUndoClear() {
+  int j, k;
+  for (j = 0; j < E.undo.nspans; j++) {
+    undoSpan *span = &E.undo.spans[j];
+    for (k = 0; k < span->oldn; k++)
+      if (span->rows[k].chars) editorTextFree(span->rows[k].chars);
+    if (E.undo.rows == NULL) free(span->rows);
+  }
+  free(E.undo.rows);
+  free(E.undo.spans);
+  E.undo.rows = NULL;
+  E.undo.spans = NULL;
+  E.undo.nspans = 0;
+  E.undo.cap = 0;
+}
+
+// Records that n rows at at replaced the oldn rows given, which now belong to
+// the undo record. Spans must be added from the top of the file down
+void editorUndoAdd(int at, int n, erow *rows, int oldn) {
+  if (E.undo.nspans == E.undo.cap) {
+    E.undo.cap = E.undo.cap ? E.undo.cap * 2 : 16;
+    E.undo.spans = realloc(E.undo.spans, sizeof(undoSpan) * E.undo.cap);
+  }
+  undoSpan *span = &E.undo.spans[E.undo.nspans++];
+  span->at = at;
+  span->n = n;
+  span->oldn = oldn;
+  span->rows = rows;
+}
+
+// Puts back the rows of the last change, going from the bottom up so the
+// positions of the spans stay valid
+void editorUndo() {
+  if (E.undo.nspans == 0 || E.undo.dirty != E.dirty) {
+    editorSetStatusMessage("Nothing to undo");
+    return;
+  }
+  int j, k;
+  for (j = E.undo.nspans - 1; j >= 0; j--) {
+    undoSpan *span = &E.undo.spans[j];
+    editorReplaceRows(span->at, span->n, span->rows, span->oldn);
+    for (k = span->at; k < span->at + span->oldn; k++) {
+      erow *row = &E.row[k];
+      row->rsize = 0;
+      row->cost = 0;
+      // Rows kept in the spill file by the undo record stay paged out
+      if (row->chars == NULL) continue;
+      row->flags = ROW_MODIFIED | ROW_REF;
+      editorUpdateRow(row);
+    }
+    if (E.undo.rows == NULL) free(span->rows);
+  }
+  int nspans = E.undo.nspans;
+  free(E.undo.rows);
+  free(E.undo.spans);
+  E.undo.rows = NULL;
+  E.undo.spans = NULL;
+  E.undo.nspans = 0;
+  E.undo.cap = 0;
+
+  if (E.cy > E.numrows) E.cy = E.numrows;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  editorSetStatusMessage("Undid %d changes", nspans);
+}
+
+/*** registers ***/
+
+// Fills dst with a row that shares the text of src, or points to the same
+// place on disk when src is paged out
+void editorRowShare(erow *dst, erow *src) {
+  memset(dst, 0, sizeof(erow));
+  dst->size = src->size;
+  dst->off = src->off;
+  dst->flags = src->flags & (ROW_MODIFIED | ROW_SPILLED);
+  if (src->chars) dst->chars = editorTextShare(src->chars);
+}
+
+void editorRegisterFree(struct yankRegister *reg) {
+  int j;
+  for (j = 0; j < reg->n; j++)
+    if (reg->rows[j].chars) editorTextFree(reg->rows[j].chars);
+  free(reg->rows);
+  reg->rows = NULL;
+  reg->n = 0;
+}
+
+// Copies n rows at at into the unnamed register and the one chosen with ".
+// No text is copied, the registers take references to it
+void editorYank(int at, int n) {
+  int regs[2] = {26, E.yankreg}, r, j;
+  for (r = 0; r < 2 && regs[r] != -1; r++) {
+    struct yankRegister *reg = &E.yanks[regs[r]];
+    editorRegisterFree(reg);
+    reg->rows = malloc(sizeof(erow) * (n ? n : 1));
+    for (j = 0; j < n; j++) editorRowShare(&reg->rows[j], &E.row[at + j]);
+    reg->n = n;
+  }
+}
+
+// dd: moves n rows at at to the registers, the undo record keeps them too
+void editorDeleteRows(int at, int n) {
+  if (at >= E.numrows) return;
+  if (n > E.numrows - at) n = E.numrows - at;
+  editorYank(at, n);
+  erow *old = malloc(sizeof(erow) * n);
+  int j;
+  for (j = 0; j < n; j++) editorRowShare(&old[j], &E.row[at + j]);
+  editorUndoClear();
+  editorReplaceRows(at, n, NULL, 0);
+  editorUndoAdd(at, 0, old, n);
+  E.undo.dirty = E.dirty;
+
+  E.cy = at < E.numrows ? at : (E.numrows > 0 ? E.numrows - 1 : 0);
+  E.cx = 0;
+  if (n > 1) editorSetStatusMessage("%d fewer lines", n);
+}
+
+// p and P: puts the rows of the register count times after the cursor row, or
+// before it, with a single move of the rows below
+void editorPut(int before, int count) {
+  struct yankRegister *reg = &E.yanks[E.yankreg == -1 ? 26 : E.yankreg];
+  if (reg->n == 0) {
+    editorSetStatusMessage("Nothing in register %c",
+                           E.yankreg == -1 ? '"' : 'a' + E.yankreg);
+    return;
+  }
+  if ((long)reg->n * count > INT_MAX - E.numrows) {
+    editorSetStatusMessage("Too many lines");
+    return;
+  }
+  int n = reg->n * count, at = before || E.numrows == 0 ? E.cy : E.cy + 1, j;
+  if (at > E.numrows) at = E.numrows;
+  erow *rows = malloc(sizeof(erow) * n);
+  for (j = 0; j < n; j++) {
+    erow *row = &rows[j];
+    editorRowShare(row, &reg->rows[j % reg->n]);
+    if (row->chars) {
+      row->flags |= ROW_REF;
+      editorUpdateRow(row);
+    }
+  }
+  editorUndoClear();
+  editorReplaceRows(at, 0, rows, n);
+  editorUndoAdd(at, n, NULL, 0);
+  E.undo.dirty = E.dirty;
+  free(rows);
+  editorEnforceMemoryLimit(NULL);
+
+  E.cy = at;
+  E.cx = 0;
+  if (n > 1) editorSetStatusMessage("%d more lines", n);
+}
+
+// Registers and the undo record outlive the text of the buffer. Before the
+// file is written or read again their rows that point into it are copied to
+// the spill file, and before the buffer is closed their text is moved out of
+// its slabs
+void editorRowsKeep(erow *rows, int n, int closing) {
+  int j;
+  for (j = 0; j < n; j++) {
+    erow *row = &rows[j];
+    if (row->chars) {
+      if (!(row->flags & ROW_SPILLED)) row->flags |= ROW_MODIFIED;
+      if (closing && ((textHeader *)row->chars - 1)->cls != MVI_TEXT_MALLOC) {
+        char *text = editorTextMalloc(row->size + 1);
+        memcpy(text, row->chars, row->size + 1);
+        editorTextFree(row->chars);
+        row->chars = text;
+      }
+    } else if (!(row->flags & ROW_SPILLED)) {
+      char *buf = malloc(row->size ? row->size : 1);
+      editorRowRead(row, buf);
+      if (pwriteAll(editorSpillFd(), buf, row->size, E.spilllen) == -1)
+        die("pwrite");
+      free(buf);
+      row->off = E.spilllen;
+      row->flags |= ROW_MODIFIED | ROW_SPILLED;
+      E.spilllen += row->size;
+    }
+  }
+}
+
+void editorRegistersKeep(int closing) {
+  int j;
+  for (j = 0; j < 27; j++)
+    editorRowsKeep(E.yanks[j].rows, E.yanks[j].n, closing);
+  for (j = 0; j < E.undo.nspans; j++)
+    editorRowsKeep(E.undo.spans[j].rows, E.undo.spans[j].oldn, closing);
+}
+
+void editorDelRow(int at) {
+  if (at < 0 || at >= E.numrows) return;
+  editorWordsRemove(&E.row[at]);
+  editorFreeRow(&E.row[at]);
+  memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+  E.numrows--;
+  E.dirty++;
+  editorDirtyRows(at, 1, 0);
+}
+
+// Inserts a character into an erow at a given position
+void editorRowInsertChar(erow *row, int at, int c) {
+  editorRowLoad(row);
+  editorRowTouch(row);
+  if (at < 0 || at > row->size) at = row->size;
+  // Asks for some extra room so typing doesn't move the row on every key
+  editorRowReserve(row, 2 * (row->size + 2) + 16);
+  // memmove is like memcpy, but safe to use when source and destination overlaps
+  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+  row->size++;
+  row->chars[at] = c;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+// Inserts new line at start or middle of row
+void editorInsertNewline() {
+  // At start just adds a new row
+  if (E.cx == 0) {
+    editorInsertRow(E.cy, "", 0);
+  } else {
+    // Breaks the row at cursor position
+    erow *row = &E.row[E.cy];
+    editorRowLoad(row);
+    editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+    row = &E.row[E.cy];
+    editorRowTouch(row);
+    row->size = E.cx;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+  }
+  E.cy++;
+  E.cx = 0;
+}
+
+// Appends a row to the row before it (also modifying the size)
+void editorRowAppendString(erow *row, char *s, size_t len) {
+  editorRowLoad(row);
+  editorRowTouch(row);
+  editorRowReserve(row, 2 * (row->size + len + 1));
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+// Deletes by moving the characters and overwriting the deleted char including the null byte at the end
+void editorRowDelChar(erow *row, int at) {
+  if (at < 0 || at >= row->size) return;
+  editorRowLoad(row);
+  editorRowTouch(row);
+  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+  // Decrements row size and increment dirtiness
+  row->size--;
+  editorUpdateRow(row);
+  E.dirty++;
+}
+
+// Reads the character and calls editorRowInsertChar and passes cursor position
+void editorInsertChar(int c) {
+  if (E.cy == E.numrows) {
+    editorInsertRow(E.numrows, "", 0);
+  }
+  editorRowInsertChar(&E.row[E.cy], E.cx, c);
+  E.cx++;
+}
+
+// Reads the at cursor position and deletes it if any and moves the cursor
+void editorDelChar() {
+  if (E.cy == E.numrows) return;
+  if (E.cx == 0 && E.cy == 0) return;
+
+  erow *row = &E.row[E.cy];
+  editorRowLoad(row);
+  if (E.cx > 0) {
+    editorRowDelChar(row, E.cx - 1);
+    E.cx--;
+  } else {
+    E.cx = E.row[E.cy - 1].size;
+    editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
+    editorDelRow(E.cy);
+    E.cy--;
+  }
+}
+
+// Converts array for erow struct into a string
+char *editorRowsToString(int *buflen) {
+  int totlen = 0;
+  int j;
+
+  // Lengths of each erow + new line character
+  for (j = 0; j < E.numrows; j++)
+    totlen += E.row[j].size + 1;
+  
+  *buflen = totlen;
+  char *buf = malloc(totlen);
+  char *p = buf;
+
+  // Copy the contents of each row at the end of the buffer appending a new line
+  for (j = 0; j < E.numrows; j++) {
+    editorRowLoad(&E.row[j]);
+    memcpy(p, E.row[j].chars, E.row[j].size);
+    p += E.row[j].size;
+    *p = '\n';
+    p++;
+  }
+
+  return buf;
+}
+
+/*** diff ***/
+
+// FNV-1a hash of a line, used to compare lines quickly
+uint64_t editorHashLine(const char *s, int len) {
+  uint64_t h = 14695981039346656037ULL;
+  int j;
+  for (j = 0; j < len; j++) {
+    h ^= (unsigned char)s[j];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Compares a row with a line of the file
+int editorRowEquals(erow *row, const char *s, int len) {
+  if (row->size != len) return 0;
+  editorRowLoad(row);
+  return memcmp(row->chars, s, len) == 0;
+}
+
+// Whether two stats are of the same file, not written in between
+int editorSameStat(struct stat *a, struct stat *b) {
+  return a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+         a->st_size == b->st_size &&
+         a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+         a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+// Maps a file and finds where its lines start, without the new line and the
+// carriage returns at their end
+int editorMapLines(const char *filename, struct lineIndex *li) {
+  struct stat st;
+  li->fd = open(filename, O_RDONLY);
+  if (li->fd == -1) return -1;
+  if (fstat(li->fd, &st) == -1) {
+    close(li->fd);
+    return -1;
+  }
+  li->size = st.st_size;
+  li->map = NULL;
+  if (li->size > 0) {
+    li->map = mmap(NULL, li->size, PROT_READ, MAP_PRIVATE, li->fd, 0);
+    if (li->map == MAP_FAILED) die("mmap");
+  }
+
+  int cap = 1024;
+  li->n = 0;
+  li->offs = malloc(sizeof(off_t) * cap);
+  li->lens = malloc(sizeof(int) * cap);
+  off_t start = 0;
+  while (start < li->size) {
+    char *nl = memchr(li->map + start, '\n', li->size - start);
+    off_t end = nl ? nl - li->map : li->size;
+    off_t len = end - start;
+    while (len > 0 && li->map[start + len - 1] == '\r') len--;
+    if (li->n == cap) {
+      cap *= 2;
+      li->offs = realloc(li->offs, sizeof(off_t) * cap);
+      li->lens = realloc(li->lens, sizeof(int) * cap);
+    }
+    li->offs[li->n] = start;
+    li->lens[li->n++] = len;
+    start = end + 1;
+  }
+  return 0;
+}
+
+void editorUnmapLines(struct lineIndex *li) {
+  if (li->map) munmap(li->map, li->size);
+  if (li->fd != -1) close(li->fd);
+  free(li->offs);
+  free(li->lens);
+  li->map = NULL;
+  li->offs = NULL;
+  li->lens = NULL;
+  li->fd = -1;
+  li->n = 0;
+}
+
+// State of a diff: the hashes of both sides and the hunks found so far
+struct diffContext {
+  const uint64_t *a, *b;
+  diffHunk *hunks;
+  int nhunks, cap;
+};
+
+// Adds a hunk, merging it with the previous one when they touch
+void diffEmit(struct diffContext *ctx, int astart, int alen, int bstart,
+              int blen) {
+  if (alen == 0 && blen == 0) return;
+  if (ctx->nhunks > 0) {
+    diffHunk *last = &ctx->hunks[ctx->nhunks - 1];
+    if (last->astart + last->alen == astart &&
+        last->bstart + last->blen == bstart) {
+      last->alen += alen;
+      last->blen += blen;
+      return;
+    }
+  }
+  if (ctx->nhunks == ctx->cap) {
+    ctx->cap = ctx->cap ? ctx->cap * 2 : 16;
+    ctx->hunks = realloc(ctx->hunks, sizeof(diffHunk) * ctx->cap);
+  }
+  diffHunk *h = &ctx->hunks[ctx->nhunks++];
+  h->astart = astart;
+  h->alen = alen;
+  h->bstart = bstart;
+  h->blen = blen;
+}
+
+void diffRecurse(struct diffContext *ctx, int a0, int a1, int b0, int b1);
+
+// Myers' middle snake: walks the edit graph of a[a0, a1) and b[b0, b1) from
+// both ends at once, keeping only one diagonal vector per direction, until the
+// paths meet. Then each half is solved on its own, so the memory stays linear.
+// Gives up after MVI_DIFF_MAX_D edits and reports the whole range as changed
+void diffBisect(struct diffContext *ctx, int a0, int a1, int b0, int b1) {
+  const uint64_t *a = ctx->a + a0, *b = ctx->b + b0;
+  int n = a1 - a0, m = b1 - b0;
+  int maxd = (n + m + 1) / 2;
+  if (maxd > MVI_DIFF_MAX_D) maxd = MVI_DIFF_MAX_D;
+  int voff = maxd, vlen = 2 * maxd + 2;
+  int *v1 = malloc(sizeof(int) * vlen), *v2 = malloc(sizeof(int) * vlen);
+  int j, d, k1, k2;
+  for (j = 0; j < vlen; j++) v1[j] = v2[j] = -1;
+  v1[voff + 1] = 0;
+  v2[voff + 1] = 0;
+  int delta = n - m;
+  // Odd deltas meet in the forward pass, even ones in the reverse pass
+  int front = delta % 2 != 0;
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+  int x1 = 0, y1 = 0, x2;
+
+  for (d = 0; d < maxd; d++) {
+    for (k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+      int k1off = voff + k1;
+      if (k1 == -d || (k1 != d && v1[k1off - 1] < v1[k1off + 1]))
+        x1 = v1[k1off + 1];
+      else
+        x1 = v1[k1off - 1] + 1;
+      y1 = x1 - k1;
+      while (x1 < n && y1 < m && a[x1] == b[y1]) {
+        x1++;
+        y1++;
+      }
+      v1[k1off] = x1;
+      if (x1 > n) {
+        k1end += 2;
+      } else if (y1 > m) {
+        k1start += 2;
+      } else if (front) {
+        int k2off = voff + delta - k1;
+        if (k2off >= 0 && k2off < vlen && v2[k2off] != -1 &&
+            x1 >= n - v2[k2off])
+          goto split;
+      }
+    }
+    for (k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+      int k2off = voff + k2;
+      if (k2 == -d || (k2 != d && v2[k2off - 1] < v2[k2off + 1]))
+        x2 = v2[k2off + 1];
+      else
+        x2 = v2[k2off - 1] + 1;
+      int y2 = x2 - k2;
+      while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+        x2++;
+        y2++;
+      }
+      v2[k2off] = x2;
+      if (x2 > n) {
+        k2end += 2;
+      } else if (y2 > m) {
+        k2start += 2;
+      } else if (!front) {
+        int k1off = voff + delta - k2;
+        if (k1off >= 0 && k1off < vlen && v1[k1off] != -1) {
+          x1 = v1[k1off];
+          y1 = voff + x1 - k1off;
+          if (x1 >= n - x2) goto split;
+        }
+      }
+    }
+  }
+  free(v1);
+  free(v2);
+  diffEmit(ctx, a0, n, b0, m);
+  return;
+
+split:
+  free(v1);
+  free(v2);
+  diffRecurse(ctx, a0, a0 + x1, b0, b0 + y1);
+  diffRecurse(ctx, a0 + x1, a1, b0 + y1, b1);
+}
+
+// Skips the lines equal at both ends of the ranges and diffs the rest
+void diffRecurse(struct diffContext *ctx, int a0, int a1, int b0, int b1) {
+  while (a0 < a1 && b0 < b1 && ctx->a[a0] == ctx->b[b0]) {
+    a0++;
+    b0++;
+  }
+  while (a0 < a1 && b0 < b1 && ctx->a[a1 - 1] == ctx->b[b1 - 1]) {
+    a1--;
+    b1--;
+  }
+  if (a0 == a1 || b0 == b1) {
+    diffEmit(ctx, a0, a1 - a0, b0, b1 - b0);
+    return;
+  }
+  diffBisect(ctx, a0, a1, b0, b1);
+}
+
+// Diffs the rows of the buffer (a) against the lines of a file (b). The first
+// pre and last suf rows are known to be equal, the ends that are equal past
+// them are skipped comparing the text directly, only the lines in between are
+// hashed. Returns the number of hunks
+int editorDiffRows(struct lineIndex *li, int pre, int suf, diffHunk **hunks) {
+  while (pre < E.numrows && pre < li->n &&
+         editorRowEquals(&E.row[pre], li->map + li->offs[pre], li->lens[pre]))
+    pre++;
+  while (suf < E.numrows - pre && suf < li->n - pre &&
+         editorRowEquals(&E.row[E.numrows - 1 - suf],
+                         li->map + li->offs[li->n - 1 - suf],
+                         li->lens[li->n - 1 - suf]))
+    suf++;
+
+  int n = E.numrows - pre - suf, m = li->n - pre - suf, j;
+  uint64_t *a = malloc(sizeof(uint64_t) * (n + 1));
+  uint64_t *b = malloc(sizeof(uint64_t) * (m + 1));
+  for (j = 0; j < n; j++) {
+    erow *row = &E.row[pre + j];
+    editorRowLoad(row);
+    a[j] = editorHashLine(row->chars, row->size);
+  }
+  for (j = 0; j < m; j++)
+    b[j] = editorHashLine(li->map + li->offs[pre + j], li->lens[pre + j]);
+
+  struct diffContext ctx = { a, b, NULL, 0, 0 };
+  diffRecurse(&ctx, 0, n, 0, m);
+  for (j = 0; j < ctx.nhunks; j++) {
+    ctx.hunks[j].astart += pre;
+    ctx.hunks[j].bstart += pre;
+  }
+  free(a);
+  free(b);
+  *hunks = ctx.hunks;
+  return ctx.nhunks;
+}
+
+// Marks the rows that differ from the file on disk. Called while waiting for
+// a key, it only does the work again when the buffer or the file changed.
+// Returns whether the marks changed
+int editorDiffUpdate() {
+  struct diffView *dv = &E.diff;
+  struct stat st;
+  int ondisk = stat(E.filename, &st) == 0;
+  int diskchanged = !ondisk || !editorSameStat(&st, &dv->st);
+  if (!diskchanged && dv->dirty == E.dirty && dv->numrows == E.numrows)
+    return 0;
+
+  if (diskchanged) {
+    editorUnmapLines(&dv->disk);
+    if (!ondisk || editorMapLines(E.filename, &dv->disk) == -1) {
+      editorSetStatusMessage("Can't diff: %s", strerror(errno));
+      dv->active = 0;
+      return 1;
+    }
+    dv->st = st;
+  }
+
+  // The rows outside the changed range are the lines of the file the buffer
+  // was read from or saved to, only the range is diffed and paged in
+  int pre = 0, suf = 0;
+  if (editorSameStat(&dv->st, &E.filestat)) {
+    pre = E.dirtylo < E.numrows ? E.dirtylo : E.numrows;
+    suf = E.numrows - (E.dirtyhi > pre ? E.dirtyhi : pre);
+    if (pre > dv->disk.n) pre = dv->disk.n;
+    if (suf > E.numrows - pre) suf = E.numrows - pre;
+    if (suf > dv->disk.n - pre) suf = dv->disk.n - pre;
+  }
+
+  diffHunk *hunks;
+  int nhunks = editorDiffRows(&dv->disk, pre, suf, &hunks);
+  int j, k;
+  free(dv->marks);
+  dv->marks = calloc(E.numrows + 1, 1);
+  dv->hunks = realloc(dv->hunks, sizeof(int) * (nhunks + 1));
+  dv->nhunks = nhunks;
+  for (j = 0; j < nhunks; j++) {
+    diffHunk *h = &hunks[j];
+    int changed = h->alen < h->blen ? h->alen : h->blen;
+    for (k = 0; k < h->alen; k++)
+      dv->marks[h->astart + k] = k < changed ? DIFF_CHANGED : DIFF_ADDED;
+    // Removed lines are shown under the row above them
+    if (h->blen > h->alen && E.numrows > 0) {
+      int at = h->astart + h->alen - 1;
+      dv->marks[at < 0 ? 0 : at] |= DIFF_DELETED;
+    }
+    // Hunks past the last row start on it, or on row 0 of an empty buffer
+    dv->hunks[j] = h->astart < E.numrows ? h->astart : E.numrows - 1;
+    if (dv->hunks[j] < 0) dv->hunks[j] = 0;
+  }
+  free(hunks);
+  dv->dirty = E.dirty;
+  dv->numrows = E.numrows;
+  return 1;
+}
+
+// Turns the diff against the file on disk on or off
+void editorDiffToggle(int on) {
+  struct diffView *dv = &E.diff;
+  if (!on) {
+    dv->active = 0;
+    editorUnmapLines(&dv->disk);
+    memset(&dv->st, 0, sizeof(dv->st));
+    free(dv->marks);
+    free(dv->hunks);
+    dv->marks = NULL;
+    dv->hunks = NULL;
+    dv->nhunks = 0;
+    dv->numrows = 0;
+    return;
+  }
+  if (E.hex.active) {
+    editorSetStatusMessage("No diff in the hex view");
+    return;
+  }
+  if (E.filename == NULL) {
+    editorSetStatusMessage("No file name");
+    return;
+  }
+  dv->active = 1;
+  dv->dirty = -1;
+  editorDiffUpdate();
+  if (dv->active)
+    editorSetStatusMessage("%d hunks changed. ]c and [c to move between them",
+                           dv->nhunks);
+}
+
+// Moves the cursor to the next (dir 1) or previous (dir -1) hunk
+void editorDiffJump(int dir) {
+  struct diffView *dv = &E.diff;
+  if (!dv->active) return;
+  editorDiffUpdate();
+  if (E.numrows == 0) {
+    editorSetStatusMessage("No more hunks");
+    return;
+  }
+  int j;
+  if (dir > 0) {
+    for (j = 0; j < dv->nhunks; j++)
+      if (dv->hunks[j] > E.cy) break;
+  } else {
+    for (j = dv->nhunks - 1; j >= 0; j--)
+      if (dv->hunks[j] < E.cy) break;
+  }
+  if (j < 0 || j >= dv->nhunks) {
+    editorSetStatusMessage("No more hunks");
+    return;
+  }
+  E.cy = dv->hunks[j];
+  E.cx = 0;
+}
+
+/*** disk ***/
+
+// Remembers the identity of the file as it is now on disk
+void editorStatFile() {
+  if (E.filename == NULL || stat(E.filename, &E.filestat) == -1)
+    memset(&E.filestat, 0, sizeof(E.filestat));
+  E.diskchanged = 0;
+}
+
+// Checks if the file was replaced, truncated or written since it was read
+int editorFileChanged() {
+  struct stat st;
+  if (E.filename == NULL || E.filestat.st_ino == 0) return 0;
+  if (stat(E.filename, &st) == -1) return 1;
+  return !editorSameStat(&st, &E.filestat);
+}
+
+// Warns once when the file changes on disk
+void editorCheckDisk() {
+  if (E.diskchanged || !editorFileChanged()) return;
+  E.diskchanged = 1;
+  editorSetStatusMessage("WARNING: %s changed on disk. :e to reload, :e! to "
+                         "drop your changes", E.filename);
+  editorRefreshScreen();
+}
+
+// Starts tracking changes against the file just read, whose rows are stored
+// one after the other. Rows that would not be written back as they are (a
+// \r\n ending or no new line at the end of the file) already count as changed
+void editorDirtyInit() {
+  int j;
+  E.dirtylo = INT_MAX;
+  E.dirtyhi = 0;
+  // The words of the new rows are indexed in the background
+  editorWordsStale(0, E.numrows, E.numrows);
+  for (j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    off_t next = j + 1 < E.numrows ? E.row[j + 1].off : E.filestat.st_size;
+    if ((row->flags & ROW_MODIFIED) || row->off + row->size + 1 != next) {
+      row->flags |= ROW_MODIFIED;
+      editorDirtyRows(j, 1, 1);
+    }
+  }
+}
+
+// Called after the buffer was written to or read from disk
+void editorMarkSaved() {
+  // The last change can still be undone after saving, an older one is dropped
+  // so it doesn't look like the last change once the count starts over
+  if (E.undo.dirty == E.dirty) E.undo.dirty = 0;
+  else editorUndoClear();
+  E.dirty = 0;
+  editorStatFile();
+  if (E.follow) editorFollowSync();
+}
+
+// Reads the file again and diffs it against the rows. Only the hunks that
+// changed are replaced, the rest of the rows keep their memory and the cursor
+// stays on the same text
+void editorReload() {
+  if (E.hex.active) {
+    char *filename = strdup(E.filename);
+    editorOpen(filename);
+    free(filename);
+    editorSetStatusMessage("Reloaded %s", E.filename);
+    return;
+  }
+  editorRegistersKeep(0);
+  struct lineIndex li;
+  if (editorMapLines(E.filename, &li) == -1) {
+    editorSetStatusMessage("Can't reload! I/O error: %s", strerror(errno));
+    return;
+  }
+  diffHunk *hunks;
+  int nhunks = editorDiffRows(&li, 0, 0, &hunks);
+
+  // Rows read lazily point to the new file
+  int lazy = E.srcfd != -1;
+  erow *rows = malloc(sizeof(erow) * (li.n ? li.n : 1));
+  int a = 0, b = 0, h, j, changed = 0, cy = E.cy;
+  for (h = 0; h <= nhunks; h++) {
+    // Rows up to the next hunk are moved as they are
+    int astart = h < nhunks ? hunks[h].astart : E.numrows;
+    memcpy(&rows[b], &E.row[a], sizeof(erow) * (astart - a));
+    b += astart - a;
+    a = astart;
+    if (h == nhunks) break;
+
+    diffHunk *hk = &hunks[h];
+    if (E.cy >= hk->astart + hk->alen)
+      cy += hk->blen - hk->alen;
+    else if (E.cy >= hk->astart)
+      cy = hk->bstart + (E.cy - hk->astart < hk->blen ? E.cy - hk->astart
+                                                      : hk->blen);
+    for (j = 0; j < hk->alen; j++) {
+      editorWordsRemove(&E.row[a + j]);
+      editorFreeRow(&E.row[a + j]);
+    }
+    for (j = 0; j < hk->blen; j++) {
+      erow *row = &rows[b + j];
+      if (lazy) {
+        memset(row, 0, sizeof(erow));
+        row->size = li.lens[b + j];
+      } else {
+        editorRowInit(row, li.map + li.offs[b + j], li.lens[b + j]);
+      }
+    }
+    a += hk->alen;
+    b += hk->blen;
+    changed += hk->alen > hk->blen ? hk->alen : hk->blen;
+  }
+  free(hunks);
+  editorRowsFree();
+  E.row = rows;
+  E.numrows = li.n;
+  E.rowcap = li.n ? li.n : 1;
+
+  // Every row now matches the file on disk
+  for (j = 0; j < E.numrows; j++) {
+    E.row[j].off = li.offs[j];
+    E.row[j].flags &= ~(ROW_MODIFIED | ROW_SPILLED);
+  }
+  if (lazy) {
+    close(E.srcfd);
+    E.srcfd = li.fd;
+    li.fd = -1;
+  }
+  editorUnmapLines(&li);
+
+  // Keeps the cursor on the same text
+  E.cy = cy > E.numrows ? E.numrows : cy;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+
+  editorUndoClear();
+  editorMarkSaved();
+  editorDirtyInit();
+  editorSetStatusMessage("Reloaded %s: %d lines changed in %d hunks",
+                         E.filename, changed, nhunks);
+}
+
+// Appends a paged out row that points to len bytes at off in the source file
+void editorAppendLazyRow(off_t off, int len) {
+  editorRowsReserve(E.numrows + 1);
+  erow *row = &E.row[E.numrows++];
+  row->size = len;
+  row->rsize = 0;
+  row->chars = NULL;
+  row->off = off;
+  row->cost = 0;
+  row->flags = 0;
+  // Its words are indexed in the background
+  editorWordsStale(E.numrows - 1, 0, 1);
+}
+
+// Scans the file for line breaks without keeping any text in memory, the rows
+// are paged in when they are used. When stats is given it also collects the
+// statistics kept in the line-index cache
+void editorOpenLazy(int fd, struct indexHeader *stats) {
+  char *buf = malloc(MVI_IO_CHUNK);
+  off_t bufstart = 0, start = 0;
+  ssize_t n;
+  int special = 0;
+
+  while ((n = read(fd, buf, MVI_IO_CHUNK)) > 0) {
+    char *p = buf, *nl;
+    while ((nl = memchr(p, '\n', n - (p - buf))) != NULL) {
+      off_t end = bufstart + (nl - buf);
+      if (stats) {
+        // Carriage returns at the end are not counted as control characters
+        char *e = nl;
+        while (e > p && e[-1] == '\r') e--;
+        if (special || editorFindSpecial(p, 0, e - p) < e - p)
+          stats->speciallines++;
+        special = 0;
+      }
+      // Strips the carriage returns before the new line like getline does
+      while (end > start) {
+        char c;
+        if (end - 1 >= bufstart) c = buf[end - 1 - bufstart];
+        else if (pread(fd, &c, 1, end - 1) != 1) die("pread");
+        if (c != '\r') break;
+        end--;
+      }
+      editorAppendLazyRow(start, end - start);
+      if (stats && (uint64_t)(end - start) > stats->maxlen)
+        stats->maxlen = end - start;
+      start = bufstart + (nl - buf) + 1;
+      p = nl + 1;
+    }
+    // Part of a line that continues in the next chunk
+    if (stats && p < buf + n && editorFindSpecial(p, 0, buf + n - p) < buf + n - p)
+      special = 1;
+    bufstart += n;
+  }
+  if (n == -1) die("read");
+  // Last line without a new line at the end
+  if (start < bufstart) {
+    editorAppendLazyRow(start, bufstart - start);
+    if (stats) {
+      if (special) stats->speciallines++;
+      if ((uint64_t)(bufstart - start) > stats->maxlen)
+        stats->maxlen = bufstart - start;
+    }
+  }
+  if (stats) stats->nlines = E.numrows;
+  free(buf);
+}
+
+// Writes len bytes, retrying on short writes
+int writeAll(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*** index cache ***/
+
+// The cache of file.txt is .file.txt.mvi-index in the same directory
+void editorIndexPath(char *path, size_t size) {
+  const char *slash = strrchr(E.filename, '/');
+  if (slash)
+    snprintf(path, size, "%.*s/.%s.mvi-index", (int)(slash - E.filename),
+             E.filename, slash + 1);
+  else
+    snprintf(path, size, ".%s.mvi-index", E.filename);
+}
+
+// Fills the key of the cache: the identity of the file as it is on disk now
+int editorIndexKey(struct indexHeader *h, char *realname) {
+  struct stat st;
+  if (fstat(E.srcfd, &st) == -1 || realpath(E.filename, realname) == NULL)
+    return -1;
+  memset(h, 0, sizeof(*h));
+  memcpy(h->magic, MVI_INDEX_MAGIC, sizeof(h->magic));
+  h->size = st.st_size;
+  h->mtime_sec = st.st_mtim.tv_sec;
+  h->mtime_nsec = st.st_mtim.tv_nsec;
+  h->ino = st.st_ino;
+  h->dev = st.st_dev;
+  h->pathlen = strlen(realname);
+  return 0;
+}
+
+// Maps the cache and, if it still describes the file, uses the rows stored in
+// it without reading the file. The rows are a private mapping, so only the
+// pages that are used are read, and changed pages are copied. The text of the
+// rows is read when it is used. Returns -1 if there is no valid cache
+int editorLoadIndex() {
+  char path[PATH_MAX + 32], realname[PATH_MAX];
+  struct indexHeader key, h;
+  if (editorIndexKey(&key, realname) == -1) return -1;
+  editorIndexPath(path, sizeof(path));
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return -1;
+  // The rows are used as they are, so only a cache of our own is trusted
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_uid != getuid() ||
+      pread(fd, &h, sizeof(h), 0) != sizeof(h)) {
+    close(fd);
+    return -1;
+  }
+
+  // A cache from another version of the file is stale
+  size_t pathpad = (h.pathlen + 7) & ~7ULL;
+  size_t tableoff = sizeof(h) + pathpad;
+  int valid = memcmp(h.magic, key.magic, sizeof(key.magic)) == 0 &&
+              h.size == key.size && h.mtime_sec == key.mtime_sec &&
+              h.mtime_nsec == key.mtime_nsec && h.ino == key.ino &&
+              h.dev == key.dev && h.pathlen == key.pathlen &&
+              h.nlines < INT_MAX / 2 &&
+              (size_t)st.st_size == tableoff + h.nlines * sizeof(erow);
+  if (!valid) {
+    close(fd);
+    return -1;
+  }
+
+  // Address space for twice the rows, so new rows rarely move the array. The
+  // cache is mapped over its start
+  int cap = h.nlines < 32 ? 64 : 2 * h.nlines;
+  long page = sysconf(_SC_PAGESIZE);
+  size_t len = (tableoff + cap * sizeof(erow) + page - 1) & ~(page - 1);
+  char *map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map != MAP_FAILED &&
+      mmap(map, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           fd, 0) == MAP_FAILED) {
+    munmap(map, len);
+    map = MAP_FAILED;
+  }
+  close(fd);
+  if (map == MAP_FAILED) return -1;
+  if (memcmp(map + sizeof(h), realname, key.pathlen) != 0) {
+    munmap(map, len);
+    return -1;
+  }
+
+  E.rowmap = map;
+  E.rowmaplen = len;
+  E.row = (erow *)(map + tableoff);
+  E.rowcap = cap;
+  E.numrows = h.nlines;
+  E.dirtylo = h.dirtylo < (uint64_t)E.numrows ? (int)h.dirtylo : INT_MAX;
+  E.dirtyhi = h.dirtylo < (uint64_t)E.numrows ? (int)h.dirtyhi : 0;
+  // The words of the rows are indexed in the background
+  editorWordsStale(0, E.numrows, E.numrows);
+  editorSetStatusMessage("Index cache: %d lines, longest %llu, %llu with tabs "
+                         "or control characters", E.numrows,
+                         (unsigned long long)h.maxlen,
+                         (unsigned long long)h.speciallines);
+  return 0;
+}
+
+// Writes the cache of the rows, which must match the file on disk, as they
+// are laid out in E.row with their text paged out. It is written to a
+// temporary file and renamed so readers never see half of it
+void editorWriteIndex(struct indexHeader *stats) {
+  char path[PATH_MAX + 32], tmp[PATH_MAX + 48], realname[PATH_MAX];
+  struct indexHeader h;
+  if (editorIndexKey(&h, realname) == -1) return;
+  h.nlines = E.numrows;
+  h.maxlen = stats->maxlen;
+  h.speciallines = stats->speciallines;
+  h.dirtylo = INT_MAX;
+  h.dirtyhi = 0;
+  editorIndexPath(path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd == -1) return;
+
+  size_t pathpad = (h.pathlen + 7) & ~7ULL;
+  size_t size = sizeof(h) + pathpad + (size_t)E.numrows * sizeof(erow);
+  char *buf = calloc(1, size);
+  erow *rows = (erow *)(buf + sizeof(h) + pathpad);
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    rows[j].size = row->size;
+    rows[j].off = row->off;
+    // Rows that would not be written back as they are count as changed
+    off_t next = j + 1 < E.numrows ? E.row[j + 1].off : (off_t)h.size;
+    if ((row->flags & ROW_MODIFIED) || row->off + row->size + 1 != next) {
+      rows[j].flags = ROW_MODIFIED;
+      if (h.dirtylo == INT_MAX) h.dirtylo = j;
+      h.dirtyhi = j + 1;
+    }
+  }
+  memcpy(buf, &h, sizeof(h));
+  memcpy(buf + sizeof(h), realname, h.pathlen);
+  if (writeAll(fd, buf, size) == 0 && close(fd) == 0) {
+    if (rename(tmp, path) == -1) unlink(tmp);
+  } else {
+    close(fd);
+    unlink(tmp);
+  }
+  free(buf);
+}
+
+/*** hex ***/
+
+// Binary files have NUL bytes near the start, text files don't
+int editorIsBinary(int fd) {
+  char *buf = malloc(MVI_HEX_SNIFF);
+  ssize_t n = pread(fd, buf, MVI_HEX_SNIFF, 0);
+  int binary = n > 0 && memchr(buf, '\0', n) != NULL;
+  free(buf);
+  return binary;
+}
+
+// Reads the size of the file again and forgets the bytes read, called before
+// drawing since another program may have changed the file
+void editorHexStat() {
+  struct stat st;
+  E.hex.size = fstat(E.hex.fd, &st) == 0 ? st.st_size : 0;
+  E.hex.winlen = 0;
+}
+
+// Shows the open file in hex. Only a window of the file is kept, so the
+// memory used doesn't grow with the file
+void editorHexOpen(int fd) {
+  E.hex.active = 1;
+  E.hex.fd = fd;
+  E.hex.cursor = 0;
+  E.hex.top = 0;
+  E.hex.nibble = 0;
+  E.hex.window = malloc(MVI_HEX_WINDOW);
+  editorHexStat();
+}
+
+void editorHexClose() {
+  if (E.hex.fd != -1) close(E.hex.fd);
+  free(E.hex.window);
+  free(E.hex.edits);
+  E.hex.window = NULL;
+  E.hex.winlen = 0;
+  E.hex.size = 0;
+  E.hex.fd = -1;
+  E.hex.edits = NULL;
+  E.hex.nedits = 0;
+  E.hex.editcap = 0;
+  E.hex.active = 0;
+}
+
+// Position of the first change at or after off
+int editorHexFind(off_t off) {
+  int lo = 0, hi = E.hex.nedits;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (E.hex.edits[mid].off < off) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// The byte at off as it is in the buffer. Returns -1 past the end
+int editorHexByte(off_t off, int *changed) {
+  int i = editorHexFind(off);
+  *changed = i < E.hex.nedits && E.hex.edits[i].off == off;
+  if (*changed) return E.hex.edits[i].byte;
+  if (off < 0 || off >= E.hex.size) return -1;
+  if (off < E.hex.winoff || off >= E.hex.winoff + (off_t)E.hex.winlen) {
+    E.hex.winoff = off - off % MVI_HEX_WINDOW;
+    ssize_t n = pread(E.hex.fd, E.hex.window, MVI_HEX_WINDOW, E.hex.winoff);
+    E.hex.winlen = n > 0 ? n : 0;
+  }
+  // The file may have become shorter since its size was read
+  if (off >= E.hex.winoff + (off_t)E.hex.winlen) return -1;
+  return E.hex.window[off - E.hex.winoff];
+}
+
+// Changes the byte at off. The file is only written on save
+void editorHexSet(off_t off, unsigned char byte) {
+  int i = editorHexFind(off);
+  if (i == E.hex.nedits || E.hex.edits[i].off != off) {
+    if (E.hex.nedits == E.hex.editcap) {
+      E.hex.editcap = E.hex.editcap ? E.hex.editcap * 2 : 64;
+      E.hex.edits = realloc(E.hex.edits, sizeof(struct hexEdit) * E.hex.editcap);
+    }
+    memmove(&E.hex.edits[i + 1], &E.hex.edits[i],
+            sizeof(struct hexEdit) * (E.hex.nedits - i));
+    E.hex.nedits++;
+    E.hex.edits[i].off = off;
+  }
+  E.hex.edits[i].byte = byte;
+  E.dirty++;
+}
+
+// Moves the cursor to a byte, keeping it inside the file
+void editorHexGoTo(off_t off) {
+  if (off >= E.hex.size) off = E.hex.size ? E.hex.size - 1 : 0;
+  if (off < 0) off = 0;
+  E.hex.cursor = off;
+  E.hex.nibble = 0;
+}
+
+// Removes the cache after the file changed without it being written again
+void editorDropIndex() {
+  char path[PATH_MAX + 32];
+  editorIndexPath(path, sizeof(path));
+  unlink(path);
+}
+
+// Drops every row of the buffer. The text in the slabs is released in bulk,
+// only the big rows are freed one by one
+void editorCloseBuffer() {
+  int j;
+  editorUndoClear();
+  editorRegistersKeep(1);
+  editorHexClose();
+  editorCompleteEnd();
+  editorWordsClear();
+  for (j = 0; j < E.numrows; j++) {
+    char *text = E.row[j].chars;
+    if (text && ((textHeader *)text - 1)->cls == MVI_TEXT_MALLOC)
+      editorTextFree(text);
+  }
+  editorArenaRelease();
+  editorRowsFree();
+  E.numrows = 0;
+  E.rowbytes = 0;
+  if (E.srcfd != -1) close(E.srcfd);
+  E.srcfd = -1;
+}
+
+// Reads the disk (a file)
+void editorOpen(char *filename) {
+  editorCloseBuffer();
+  free(E.filename);
+  E.filename = strdup(filename);
+
+  // Binary files are shown in hex instead of being split in rows
+  int fd = open(filename, O_RDONLY);
+  if (fd != -1 && (E.hex.forced || editorIsBinary(fd))) {
+    editorHexOpen(fd);
+    E.dirty = 0;
+    editorStatFile();
+    return;
+  }
+  if (fd != -1) close(fd);
+
+  // Only the line offsets are read, from the cache if there is a valid one
+  if (E.memlimit || E.indexcache) {
+    E.srcfd = open(filename, O_RDONLY);
+    if (E.srcfd == -1) die("open");
+    int cached = 0;
+    if (!E.indexcache) {
+      editorOpenLazy(E.srcfd, NULL);
+    } else if (editorLoadIndex() == -1) {
+      struct indexHeader stats;
+      memset(&stats, 0, sizeof(stats));
+      editorOpenLazy(E.srcfd, &stats);
+      editorWriteIndex(&stats);
+    } else {
+      cached = 1;
+    }
+    E.dirty = 0;
+    editorStatFile();
+    // The cache already knows which rows count as changed
+    if (!cached) editorDirtyInit();
+    return;
+  }
+
+  FILE *fp = fopen(filename, "r");
+  if (!fp) die("fopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+  off_t off = 0;
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    ssize_t len = linelen;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      len--;
+    editorInsertRow(E.numrows, line, len);
+    // Remembers where the row is so a save can leave it alone
+    E.row[E.numrows - 1].off = off;
+    E.row[E.numrows - 1].flags &= ~ROW_MODIFIED;
+    off += linelen;
+  }
+  free(line);
+  fclose(fp);
+  E.dirty = 0;
+  editorStatFile();
+  editorDirtyInit();
+}
+
+/*** follow ***/
+
+// Opens the file and watches it again, and finds where the rows end in it.
+// Called when following starts and after a save or reload, which can put a
+// new file in place of the one that was followed
+void editorFollowSync() {
+  if (E.followfd != -1) close(E.followfd);
+  if (E.followwd != -1) inotify_rm_watch(E.inotifyfd, E.followwd);
+  E.followfd = open(E.filename, O_RDONLY);
+  if (E.followfd == -1) die("open");
+  E.followwd = inotify_add_watch(E.inotifyfd, E.filename, IN_MODIFY);
+  if (E.followwd == -1) die("inotify_add_watch");
+
+  struct stat st;
+  if (fstat(E.followfd, &st) == -1) die("fstat");
+  E.followoff = st.st_size;
+  E.followpartend = st.st_size;
+  E.followpartial = 0;
+
+  // Finds the start of an unfinished last line
+  char c;
+  if (E.followoff > 0 && pread(E.followfd, &c, 1, E.followoff - 1) == 1 &&
+      c != '\n' && E.numrows > 0) {
+    while (E.followoff > 0 &&
+           pread(E.followfd, &c, 1, E.followoff - 1) == 1 && c != '\n')
+      E.followoff--;
+    E.followpartial = 1;
+  }
+}
+
+// Starts watching the open file for appended data, like tail -f. The last line
+// is re-read while it doesn't end with a new line
+void editorFollowStart() {
+  E.inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (E.inotifyfd == -1) die("inotify_init1");
+  editorFollowSync();
+  E.follow = 1;
+}
+
+// Appends a line read by follow mode. In bounded-memory mode the row just
+// points to the file
+void editorFollowAppendRow(off_t off, char *s, int len) {
+  while (len > 0 && s[len - 1] == '\r') len--;
+  if (E.srcfd != -1) {
+    editorAppendLazyRow(off, len);
+  } else {
+    editorInsertRow(E.numrows, s, len);
+    E.row[E.numrows - 1].off = off;
+    E.row[E.numrows - 1].flags &= ~ROW_MODIFIED;
+  }
+}
+
+// Whether the last row still is the unfinished line follow mode appended,
+// with the text it was read with. Once it was edited it is a normal row
+int editorFollowPartialRow() {
+  if (!E.followpartial || E.numrows == 0) return 0;
+  erow *row = &E.row[E.numrows - 1];
+  if (row->off != E.followoff || row->size > E.followpartend - E.followoff)
+    return 0;
+  // A copy of it was put after it
+  if (E.numrows > 1 && E.row[E.numrows - 2].off == E.followoff) return 0;
+  // Paged out rows that weren't spilled still are the text in the file
+  if (row->chars == NULL && !(row->flags & ROW_SPILLED)) return 1;
+
+  editorRowLoad(row);
+  char *buf = malloc(row->size + 1);
+  int same = pread(E.followfd, buf, row->size, E.followoff) == row->size &&
+             memcmp(buf, row->chars, row->size) == 0;
+  free(buf);
+  return same;
+}
+
+// Reads the bytes appended since the last call and adds them as rows
+void editorFollowRead() {
+  struct stat st;
+  off_t end = E.followpartial ? E.followpartend : E.followoff;
+  if (fstat(E.followfd, &st) == -1) return;
+  if (st.st_size < end) {
+    // The file was truncated, keeps following from its new end
+    E.followoff = st.st_size;
+    E.followpartial = 0;
+    editorSetStatusMessage("%s was truncated", E.filename);
+    return;
+  }
+  if (st.st_size == end) return;
+
+  int dirty = E.dirty, lo = E.dirtylo, hi = E.dirtyhi, first, j;
+  // The unfinished last line is read again together with the new data. If it
+  // was changed in the buffer it is kept, and the rest of the line on disk
+  // becomes a row of its own
+  if (editorFollowPartialRow()) {
+    editorWordsRemove(&E.row[E.numrows - 1]);
+    editorFreeRow(&E.row[E.numrows - 1]);
+    E.numrows--;
+  } else if (E.followpartial) {
+    E.followoff = E.followpartend;
+  }
+  E.followpartial = 0;
+  first = E.numrows;
+
+  size_t cap = MVI_IO_CHUNK;
+  char *buf = malloc(cap);
+  size_t have = 0;
+  ssize_t n;
+  while ((n = pread(E.followfd, buf + have, cap - have,
+                    E.followoff + have)) > 0) {
+    have += n;
+    char *p = buf, *nl;
+    while ((nl = memchr(p, '\n', have - (p - buf))) != NULL) {
+      editorFollowAppendRow(E.followoff, p, nl - p);
+      E.followoff += nl - p + 1;
+      p = nl + 1;
+    }
+    // Moves the unfinished line to the start of the buffer, growing the
+    // buffer if a single line doesn't fit
+    have -= p - buf;
+    memmove(buf, p, have);
+    if (have == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+  }
+  if (have > 0) {
+    editorFollowAppendRow(E.followoff, buf, have);
+    E.followpartend = E.followoff + have;
+    E.followpartial = 1;
+  }
+  free(buf);
+
+  // The new rows already are on disk. Like when the file is read, only the
+  // ones that would not be written back as they are count as changed
+  E.dirty = dirty;
+  E.dirtylo = lo;
+  E.dirtyhi = hi < first ? hi : first;
+  if (E.dirtylo >= E.dirtyhi) {
+    E.dirtylo = INT_MAX;
+    E.dirtyhi = 0;
+  }
+  for (j = first; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    off_t next = j + 1 < E.numrows ? E.row[j + 1].off :
+                 E.followpartial ? E.followpartend : E.followoff;
+    if (row->off + row->size + 1 != next) {
+      row->flags |= ROW_MODIFIED;
+      editorDirtyRows(j, 1, 1);
+    }
+  }  // The buffer matches the file as it is now, so saving doesn't warn about it
+  editorStatFile();
+}
+
+// Drains the inotify events and appends the new data in one batch. If the end
+// of the file was visible the view moves along with it
+void editorFollowPoll() {
+  char events[4096];
+  int changed = 0;
+  while (read(E.inotifyfd, events, sizeof(events)) > 0) changed = 1;
+  if (!changed) return;
+
+  int atend = E.rowoff + E.screenrows >= E.numrows;
+  int numrows = E.numrows;
+  editorFollowRead();
+  if (E.numrows == numrows && !E.followpartial) return;
+
+  if (atend && E.numrows > 0) {
+    E.cy = E.numrows - 1;
+    E.cx = 0;
+  }
+  editorRefreshScreen();
+}
+
+// Called while waiting for a key
+void editorIdle() {
+  if (E.follow) editorFollowPoll();
+  else editorCheckDisk();
+  if (E.diff.active && editorDiffUpdate()) editorRefreshScreen();
+  editorWordsIdle();
+}
+
+// Every row was just written to disk, one after the other
+off_t editorRowsSaved() {
+  off_t off = 0;
+  int j;
+  for (j = 0; j < E.numrows; j++) {
+    E.row[j].off = off;
+    E.row[j].flags &= ~(ROW_MODIFIED | ROW_SPILLED);
+    off += E.row[j].size + 1;
+  }
+  E.dirtylo = INT_MAX;
+  E.dirtyhi = 0;
+  return off;
+}
+
+// Saves the rows one by one into a temporary file that replaces the original,
+// so the rows that are paged out can still be read from the old file. After
+// that every row points to its new place in the saved file
+int editorSaveStreaming(long long *written) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s.mvi-XXXXXX", E.filename);
+  int fd = mkstemp(tmp);
+  if (fd == -1) return -1;
+
+  struct stat st;
+  if ((E.srcfd != -1 ? fstat(E.srcfd, &st) : stat(E.filename, &st)) == 0)
+    fchmod(fd, st.st_mode & 07777);
+
+  char *buf = malloc(MVI_IO_CHUNK);
+  size_t used = 0;
+  int j;
+  // Statistics for the line-index cache of the saved file
+  struct indexHeader stats;
+  memset(&stats, 0, sizeof(stats));
+  for (j = 0; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    char *text;
+    if ((size_t)row->size + 1 > MVI_IO_CHUNK - used) {
+      if (writeAll(fd, buf, used) == -1) goto fail;
+      used = 0;
+    }
+    if ((size_t)row->size + 1 > MVI_IO_CHUNK) {
+      // Rows bigger than the chunk are paged in and written directly
+      editorRowLoad(row);
+      text = row->chars;
+      if (writeAll(fd, row->chars, row->size) == -1 ||
+          writeAll(fd, "\n", 1) == -1) goto fail;
+    } else {
+      text = buf + used;
+      if (row->chars) memcpy(buf + used, row->chars, row->size);
+      else editorRowRead(row, buf + used);
+      used += row->size;
+      buf[used++] = '\n';
+    }
+    if (E.indexcache) {
+      int len = row->size;
+      while (len > 0 && text[len - 1] == '\r') len--;
+      if (editorFindSpecial(text, 0, len) < len) stats.speciallines++;
+      if ((uint64_t)row->size > stats.maxlen) stats.maxlen = row->size;
+    }
+  }
+  if (writeAll(fd, buf, used) == -1 || fsync(fd) == -1) goto fail;
+  if (rename(tmp, E.filename) == -1) goto fail;
+  free(buf);
+
+  // Paged out rows are read from the new file from now on
+  if (E.srcfd != -1) {
+    close(E.srcfd);
+    E.srcfd = fd;
+  } else {
+    close(fd);
+  }
+  *written = editorRowsSaved();
+  if (E.indexcache) editorWriteIndex(&stats);
+  return 0;
+
+fail:
+  free(buf);
+  close(fd);
+  unlink(tmp);
+  return -1;
+}
+
+// Writes the buffered bytes at off, retrying on short writes
+int pwriteAll(int fd, const char *buf, size_t len, off_t off) {
+  while (len > 0) {
+    ssize_t n = pwrite(fd, buf, len, off);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+    off += n;
+  }
+  return 0;
+}
+
+// Writes the changed bytes of the hex view over the file, each run of
+// neighbouring bytes with one write. The file is only opened for writing
+// here, and only if it still is the one being shown
+int editorHexSave(long long *written) {
+  struct stat shown, st;
+  int fd = open(E.filename, O_WRONLY);
+  if (fd == -1) return -1;
+  if (fstat(E.hex.fd, &shown) == -1 || fstat(fd, &st) == -1 ||
+      st.st_ino != shown.st_ino || st.st_dev != shown.st_dev) {
+    close(fd);
+    errno = ESTALE;
+    return -1;
+  }
+
+  unsigned char buf[4096];
+  int i = 0;
+  *written = 0;
+  while (i < E.hex.nedits) {
+    off_t start = E.hex.edits[i].off;
+    size_t len = 0;
+    while (i < E.hex.nedits && len < sizeof(buf) &&
+           E.hex.edits[i].off == start + (off_t)len)
+      buf[len++] = E.hex.edits[i++].byte;
+    if (pwriteAll(fd, (char *)buf, len, start) == -1) {
+      close(fd);
+      return -1;
+    }
+    *written += len;
+  }
+  if (fsync(fd) == -1 || close(fd) == -1) return -1;
+  E.hex.nedits = 0;
+  E.hex.winlen = 0;
+  return 0;
+}
+
+// Saves only the part of the file that changed, in place: the rows before the
+// first changed row are kept, and so are the rows that still are where they
+// were on disk. When the length of the file didn't change only the changed
+// rows are written. Returns 1 when saved, 0 when the whole file must be
+// rewritten instead and -1 on errors
+int editorSaveInPlace(long long *written) {
+  // The rows can only be trusted to match the disk if nobody else wrote it
+  if (E.filename == NULL || E.filestat.st_ino == 0 || editorFileChanged())
+    return 0;
+  // Other sessions of the server page their rows in from the same file, a
+  // new file is written instead so their rows keep pointing to the old one
+  if (E.srcfd != -1 && E.sessions &&
+      __atomic_load_n(E.sessions, __ATOMIC_SEQ_CST) > 1)
+    return 0;
+  off_t disksize = E.filestat.st_size;
+  int lo = E.dirtylo < E.numrows ? E.dirtylo : E.numrows;
+  int hi = E.dirtyhi < E.numrows ? E.dirtyhi : E.numrows;
+  off_t start = lo > 0 ? E.row[lo - 1].off + E.row[lo - 1].size + 1 : 0;
+
+  // Finds the rows to write: the changed ones and the ones that moved. Past
+  // the changed rows, the first row still in its place means the rest are too
+  off_t off = start, moved = 0, newsize = disksize;
+  int end = E.numrows, j;
+  for (j = lo; j < E.numrows; j++) {
+    erow *row = &E.row[j];
+    int inplace = !(row->flags & ROW_MODIFIED) && row->off == off;
+    if (j >= hi && inplace) {
+      end = j;
+      break;
+    }
+    if (!inplace && !row->chars && !(row->flags & ROW_SPILLED))
+      moved += row->size;
+    off += row->size + 1;
+  }
+  if (end == E.numrows) newsize = off;
+  // Moving most of the file costs as much as writing a new copy
+  if (E.srcfd != -1 && moved > newsize / 2) return 0;
+
+  int fd = open(E.filename, O_WRONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_ino != E.filestat.st_ino ||
+      st.st_dev != E.filestat.st_dev) {
+    close(fd);
+    return 0;
+  }
+
+  // Rows read from the file itself are copied to the spill file first, so
+  // writing over their old place can't lose them, even if the save fails
+  char *buf = malloc(MVI_IO_CHUNK);
+  for (off = start, j = lo; j < end; j++) {
+    erow *row = &E.row[j];
+    int inplace = !(row->flags & ROW_MODIFIED) && row->off == off;
+    off += row->size + 1;
+    if (inplace || (row->flags & ROW_SPILLED)) continue;
+    if (row->chars) {
+      row->flags |= ROW_MODIFIED;
+      continue;
+    }
+    if (row->size > MVI_IO_CHUNK) {
+      editorRowLoad(row);
+      row->flags |= ROW_MODIFIED;
+      continue;
+    }
+    editorRowRead(row, buf);
+    if (pwriteAll(editorSpillFd(), buf, row->size, E.spilllen) == -1) {
+      free(buf);
+      close(fd);
+      return -1;
+    }
+    row->off = E.spilllen;
+    row->flags |= ROW_MODIFIED | ROW_SPILLED;
+    E.spilllen += row->size;
+  }
+
+  // Writes each run of changed rows with as few writes as possible
+  size_t used = 0;
+  off_t bufoff = start;
+  long long total = 0;
+  for (off = start, j = lo; j < end; j++) {
+    erow *row = &E.row[j];
+    if (!(row->flags & ROW_MODIFIED) && row->off == off) {
+      off += row->size + 1;
+      continue;
+    }
+    if (used > 0 && (bufoff + (off_t)used != off ||
+                     (size_t)row->size + 1 > MVI_IO_CHUNK - used)) {
+      if (pwriteAll(fd, buf, used, bufoff) == -1) goto fail;
+      total += used;
+      used = 0;
+    }
+    if (used == 0) bufoff = off;
+    if ((size_t)row->size + 1 > MVI_IO_CHUNK) {
+      // Rows bigger than the chunk are paged in and written directly
+      editorRowLoad(row);
+      if (pwriteAll(fd, row->chars, row->size, off) == -1 ||
+          pwriteAll(fd, "\n", 1, off + row->size) == -1) goto fail;
+      total += row->size + 1;
+    } else {
+      if (row->chars) memcpy(buf + used, row->chars, row->size);
+      else editorRowRead(row, buf + used);
+      used += row->size;
+      buf[used++] = '\n';
+    }
+    off += row->size + 1;
+  }
+  if (used > 0 && pwriteAll(fd, buf, used, bufoff) == -1) goto fail;
+  total += used;
+  if (newsize != disksize && ftruncate(fd, newsize) == -1) goto fail;
+  if (fsync(fd) == -1 || close(fd) == -1) {
+    free(buf);
+    return -1;
+  }
+  free(buf);
+
+  for (off = start, j = lo; j < end; j++) {
+    E.row[j].off = off;
+    E.row[j].flags &= ~(ROW_MODIFIED | ROW_SPILLED);
+    off += E.row[j].size + 1;
+  }
+  E.dirtylo = INT_MAX;
+  E.dirtyhi = 0;
+  *written = total;
+  return 1;
+
+fail:
+  free(buf);
+  close(fd);
+  return -1;
+}
+
+// Saves the open file. Unless forced, asks before overwriting changes made by
+// another program. Returns -1 if the file was not saved
+int editorSave(int force) {
+  // When file has no name execute prompt to read user input
+  if (E.filename == NULL) {
+    E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+    if (E.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return -1;
+    }
+  }
+
+  if (!force && editorFileChanged()) {
+    char *answer = editorPrompt("File changed on disk since it was read. "
+                                "Overwrite? (y | n): %s", NULL);
+    int yes = answer && (strcmp(answer, "y") == 0 || strcmp(answer, "Y") == 0);
+    free(answer);
+    if (!yes) {
+      editorSetStatusMessage("Save aborted");
+      return -1;
+    }
+  }
+
+  long long written;
+  if (E.hex.active) {
+    if (editorHexSave(&written) == -1) {
+      editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+      return -1;
+    }
+    editorMarkSaved();
+    editorSetStatusMessage("%lld bytes written to disk", written);
+    return 0;
+  }
+
+  // Rewrites only what changed if the file is still the one that was read,
+  // otherwise replaces it with a complete new copy
+  editorRegistersKeep(0);
+  int saved = editorSaveInPlace(&written);
+  // The line-index cache of a file changed in place is out of date
+  if (saved == 1 && E.indexcache) editorDropIndex();
+  if (saved != 1 && (E.srcfd != -1 || E.filestat.st_ino != 0))
+    saved = editorSaveStreaming(&written) == 0 ? 1 : -1;
+  if (saved == 1) {
+    editorMarkSaved();
+    editorSetStatusMessage("%lld bytes written to disk", written);
+    return 0;
+  }
+  if (saved == -1) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return -1;
+  }
+
+  int len;
+  char *buf = editorRowsToString(&len);
+
+  // Create new file if doesn't exist and open with R&W permissions
+  // 0644 is the standard permission for R&W
+  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+
+  if (fd != -1) {
+    // Sets the file’s size to the specified length
+    // If larger truncates any data at the end
+    // If shorter will add padding
+    if (ftruncate(fd, len) != -1) {
+      if (write(fd, buf, len) == len) {
+        close(fd);
+        free(buf);
+        editorRowsSaved();
+        editorMarkSaved();
+        editorSetStatusMessage("%d bytes written to disk", len);
+        return 0;
+      }
+    }
+    close(fd);
+  }
+  free(buf);
+  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  return -1;
+}
+
+void countOcurrences(char* count){
+  if (count == NULL){
+    return;
+  }
+  int i;
+  int ocurrences = 0;
+  for(i = 0; i < E.numrows; i++){
+    erow *row = &E.row[i];
+    editorRowLoad(row);
+    char *word = strstr(editorRowRender(row), count);
+    if (word){
+      ocurrences++;
+    }
+  }
+  editorSetStatusMessage("Your word was %d times", ocurrences);
+}
+
+// Loop through all the rows of the file, and if a row contains their query string,
+// move the cursor to the match
+void editorFindCallback(char *query, int key) {
+  static int last_match = -1;
+  static int direction = 1;
+
+  if (key == '\r' || key == '\x1b') {
+    last_match = -1;
+    direction = 1;
+    return;
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    direction = 1;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    direction = -1;
+  } else {
+    last_match = -1;
+    direction = 1;
+  }
 
-  // Create new file if doesn't exist and open with R&W permissions
-  // 0644 is the standard permission for R&W
-  int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+  if (last_match == -1) direction = 1;
+  int current = last_match;
+  int i;
+  for (i = 0; i < E.numrows; i++) {
+    current += direction;
+    if (current == -1) current = E.numrows - 1;
+    else if (current == E.numrows) current = 0;
+    erow *row = &E.row[current];
+    editorRowLoad(row);
+    char *render = editorRowRender(row);
+    char *match = strstr(render, query);
+    if (match) {
+      last_match = current;
+      E.cy = current;
+      E.cx = editorRowRxToCx(row, match - render);
+      E.rowoff = E.numrows;
+      break;
+    }
+  }
+}
 
-  if (fd != -1) {
-    // Sets the file’s size to the specified length
-    // If larger truncates any data at the end
-    // If shorter will add padding
-    if (ftruncate(fd, len) != -1) {
-      if (write(fd, buf, len) == len) {
-        close(fd);
-        free(buf);
-        E.dirty = 0;
-        editorSetStatusMessage("%d bytes written to disk", len);
-        return;
+void editorFind(char *query) {
+  int saved_cx = E.cx;
+  int saved_cy = E.cy;
+  int saved_coloff = E.coloff;
+  int saved_rowoff = E.rowoff;
+
+  while(1) {
+    editorSetStatusMessage("Searching (navigate with arrows): %s", query);
+    editorRefreshScreen();
+    int c = editorReadKey();
+    if (c == '\x1b' || c == '\r') {
+      // Cancels prompts
+      editorSetStatusMessage("");
+      return;
+    }
+    editorFindCallback(query, c);
+  }
+
+  if (query) {
+    free(query);
+  } else {
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+  }
+}
+
+void editorGoToLine(int line) {
+  if (line > E.numrows) line = E.numrows -1;
+  E.cy = line;
+}
+
+/*** substitute ***/
+
+// A row rebuilt by a substitution
+struct substChange {
+  int at;
+  char *chars;
+  int size;
+};
+
+// Work of one thread: substitutes in rows [start, end) and keeps the rebuilt
+// rows in changes, in order
+struct substJob {
+  int start, end;
+  const char *pat, *rep;
+  int patlen, replen;
+  int global;
+  struct substChange *changes;
+  int nchanges;
+  long long count;
+};
+
+// Builds each row that has a match once into a fresh buffer. Rows that don't
+// match are left alone. Rows that are paged out are read into a buffer of the
+// thread, paging them in would touch the memory budget from many threads
+void *editorSubstRows(void *arg) {
+  struct substJob *job = arg;
+  char *buf = NULL;
+  int cap = 0, bufcap = 0, j;
+  for (j = job->start; j < job->end; j++) {
+    erow *row = &E.row[j];
+    const char *text = row->chars;
+    if (text == NULL) {
+      if (bufcap < row->size + 1) {
+        bufcap = 2 * (row->size + 1);
+        buf = realloc(buf, bufcap);
       }
+      editorRowRead(row, buf);
+      text = buf;
     }
-    close(fd);
+
+    const char *end = text + row->size;
+    const char *m = memmem(text, row->size, job->pat, job->patlen);
+    if (m == NULL) continue;
+
+    // Counts the matches to allocate the new row only once
+    int matches = 0;
+    const char *p = m;
+    while (p) {
+      matches++;
+      if (!job->global) break;
+      p = memmem(p + job->patlen, end - p - job->patlen, job->pat, job->patlen);
+    }
+    int size = row->size + matches * (job->replen - job->patlen);
+    char *chars = editorTextMalloc(size + 1);
+    const char *src = text;
+    char *dst = chars;
+    int left = matches;
+    while (left--) {
+      memcpy(dst, src, m - src);
+      dst += m - src;
+      memcpy(dst, job->rep, job->replen);
+      dst += job->replen;
+      src = m + job->patlen;
+      if (left) m = memmem(src, end - src, job->pat, job->patlen);
+    }
+    memcpy(dst, src, end - src);
+    chars[size] = '\0';
+
+    if (job->nchanges == cap) {
+      cap = cap ? cap * 2 : 64;
+      job->changes = realloc(job->changes, sizeof(struct substChange) * cap);
+    }
+    job->changes[job->nchanges].at = j;
+    job->changes[job->nchanges].chars = chars;
+    job->changes[job->nchanges].size = size;
+    job->nchanges++;
+    job->count += matches;
   }
   free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  return NULL;
 }
 
-void countOcurrences(char* count){
-  if (count == NULL){
+// Replaces pat with rep in rows [start, end). Big ranges are split between
+// threads, then the rebuilt rows are put in place and rendered again. The
+// whole substitution is one change for undo
+void editorSubstitute(int start, int end, char *pat, char *rep, int global) {
+  if (*pat == '\0' || start >= end) return;
+
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > (end - start) / MVI_PARALLEL_MIN)
+    nthreads = (end - start) / MVI_PARALLEL_MIN;
+  if (nthreads < 1) nthreads = 1;
+
+  struct substJob *jobs = calloc(nthreads, sizeof(struct substJob));
+  pthread_t *threads = malloc(sizeof(pthread_t) * nthreads);
+  int j, k;
+  for (j = 0; j < nthreads; j++) {
+    jobs[j].start = start + (long long)(end - start) * j / nthreads;
+    jobs[j].end = start + (long long)(end - start) * (j + 1) / nthreads;
+    jobs[j].pat = pat;
+    jobs[j].patlen = strlen(pat);
+    jobs[j].rep = rep;
+    jobs[j].replen = strlen(rep);
+    jobs[j].global = global;
+    if (j > 0 && pthread_create(&threads[j], NULL, editorSubstRows, &jobs[j]))
+      die("pthread_create");
+  }
+  editorSubstRows(&jobs[0]);
+  for (j = 1; j < nthreads; j++) pthread_join(threads[j], NULL);
+
+  int nrows = 0;
+  long long count = 0;
+  for (j = 0; j < nthreads; j++) {
+    nrows += jobs[j].nchanges;
+    count += jobs[j].count;
+  }
+  if (nrows == 0) {
+    editorSetStatusMessage("Pattern not found: %s", pat);
+  } else {
+    editorUndoClear();
+    E.undo.rows = malloc(sizeof(erow) * nrows);
+    int n = 0;
+    for (j = 0; j < nthreads; j++) {
+      for (k = 0; k < jobs[j].nchanges; k++) {
+        struct substChange *c = &jobs[j].changes[k];
+        erow *row = &E.row[c->at];
+
+        // The old text goes to the undo record instead of being freed, the
+        // row may have been paged out since it was read
+        editorRowLoad(row);
+        editorWordsRemove(row);
+        erow *old = &E.undo.rows[n++];
+        *old = *row;
+        E.rowbytes -= row->cost;
+
+        row->chars = c->chars;
+        row->size = c->size;
+        row->flags &= ~ROW_EXPANDED;
+        row->cost = 0;
+        editorRowTouch(row);
+        editorUpdateRow(row);
+        editorUndoAdd(c->at, 1, old, 1);
+      }
+    }
+    E.dirty++;
+    E.undo.dirty = E.dirty;
+    if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+    editorSetStatusMessage("%lld substitutions on %d lines", count, nrows);
+  }
+
+  for (j = 0; j < nthreads; j++) free(jobs[j].changes);
+  free(jobs);
+  free(threads);
+}
+
+/*** filter ***/
+
+// The part of the range still to be written to a filter: bytes in the buffer,
+// then bytes of the source file that go straight to the pipe with splice
+struct filterInput {
+  int at;
+  int end;
+  char *buf;
+  size_t cap;
+  const char *data;
+  size_t len;
+  off_t spliceoff;
+  size_t splicelen;
+  int nosplice;
+};
+
+// Rows that still are in the source file, followed by their new line
+int editorRowOnDisk(erow *row) {
+  return E.srcfd != -1 && row->chars == NULL && !(row->flags & ROW_MODIFIED);
+}
+
+// Gets the next rows of the range ready to be written. Rows still on disk and
+// next to each other become one splice, the rest are copied to the buffer
+void editorFilterNext(struct filterInput *in) {
+  in->data = in->buf;
+  in->len = 0;
+  while (in->at < in->end) {
+    erow *row = &E.row[in->at];
+    if (editorRowOnDisk(row)) {
+      if (in->len > 0) return;
+      in->spliceoff = row->off;
+      in->splicelen = 0;
+      while (in->at < in->end && editorRowOnDisk(&E.row[in->at]) &&
+             E.row[in->at].off == in->spliceoff + (off_t)in->splicelen) {
+        in->splicelen += E.row[in->at].size + 1;
+        in->at++;
+      }
+      return;
+    }
+    if ((size_t)row->size + 1 > in->cap - in->len) {
+      if (in->len > 0) return;
+      // Only a row longer than the buffer makes it grow
+      in->cap = row->size + 1;
+      in->buf = realloc(in->buf, in->cap);
+      in->data = in->buf;
+    }
+    if (row->chars) memcpy(in->buf + in->len, row->chars, row->size);
+    else editorRowRead(row, in->buf + in->len);
+    in->len += row->size;
+    in->buf[in->len++] = '\n';
+    in->at++;
+  }
+}
+
+// Writes as much of the range as the pipe takes without blocking. Returns 1
+// when the whole range was written or the filter stopped reading, and -1 when
+// the rows couldn't be read, the filter would get part of its input
+int editorFilterWrite(struct filterInput *in, int fd) {
+  while (1) {
+    ssize_t n;
+    if (in->splicelen > 0 && !in->nosplice) {
+      n = splice(E.srcfd, &in->spliceoff, fd, NULL, in->splicelen,
+                 SPLICE_F_NONBLOCK | SPLICE_F_MORE);
+      if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        in->nosplice = 1;
+        continue;
+      }
+      if (n > 0) in->splicelen -= n;
+      // The source file ended before the rows did
+      else if (n == 0) {
+        errno = EIO;
+        return -1;
+      }
+    } else if (in->splicelen > 0) {
+      // Without splice the bytes on disk pass through the buffer
+      size_t want = in->splicelen < in->cap ? in->splicelen : in->cap;
+      n = pread(E.srcfd, in->buf, want, in->spliceoff);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) {
+        if (n == 0) errno = EIO;
+        return -1;
+      }
+      in->spliceoff += n;
+      in->splicelen -= n;
+      in->data = in->buf;
+      in->len = n;
+      continue;
+    } else if (in->len > 0) {
+      n = write(fd, in->data, in->len);
+      if (n > 0) {
+        in->data += n;
+        in->len -= n;
+      }
+    } else {
+      editorFilterNext(in);
+      if (in->len == 0 && in->splicelen == 0) return 1;
+      continue;
+    }
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return 0;
+      // The filter quit reading
+      if (errno == EPIPE) return 1;
+      return -1;
+    }
+  }
+}
+
+// Adds a row for each complete line of the output. With a memory budget the
+// lines go to the spill file and the rows stay paged out, otherwise they are
+// copied into new rows. Returns the bytes used
+size_t editorFilterRows(char *s, size_t len, int final, erow **rows, int *n,
+                        int *cap) {
+  // Without the end of the output a line without its new line may continue
+  size_t used = len;
+  if (!final) {
+    char *last = memrchr(s, '\n', len);
+    if (last == NULL) return 0;
+    used = last - s + 1;
+  }
+  if (used == 0) return 0;
+
+  off_t base = E.spilllen;
+  if (E.memlimit) {
+    if (pwriteAll(editorSpillFd(), s, used, base) == -1) die("pwrite");
+    E.spilllen += used;
+  }
+  char *p = s, *nl;
+  while (p < s + used) {
+    nl = memchr(p, '\n', s + used - p);
+    if (nl == NULL) nl = s + used;
+    if (*n == *cap) {
+      *cap = *cap ? *cap * 2 : 1024;
+      *rows = realloc(*rows, sizeof(erow) * *cap);
+    }
+    erow *row = &(*rows)[(*n)++];
+    if (E.memlimit) {
+      memset(row, 0, sizeof(erow));
+      row->size = nl - p;
+      row->off = base + (p - s);
+      row->flags = ROW_MODIFIED | ROW_SPILLED;
+    } else {
+      editorRowInit(row, p, nl - p);
+    }
+    p = nl + 1;
+  }
+  return used;
+}
+
+// Reads the keys typed while a command runs. Ctrl-C stops the command, the
+// other keys are kept for after it. Returns 1 if it was stopped
+int editorCommandKeys(pid_t pid) {
+  char keys[64];
+  int j, cancelled = 0;
+  ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+  for (j = 0; j < n; j++) {
+    if (keys[j] == CTRL_KEY('c')) {
+      kill(-pid, SIGTERM);
+      cancelled = 1;
+      continue;
+    }
+    E.typeahead = realloc(E.typeahead, E.typeaheadlen + 1);
+    E.typeahead[E.typeaheadlen++] = keys[j];
+  }
+  return cancelled;
+}
+
+// Runs cmd with the rows [start, end) as its input and replaces them with its
+// output. The rows are written and the output read at the same time, so
+// neither side waits for the other, and only a buffer of each is kept in
+// memory. A failed command leaves the rows as they were
+void editorFilter(int start, int end, char *cmd) {
+  while (isspace((unsigned char)*cmd)) cmd++;
+  if (*cmd == '\0') {
+    editorSetStatusMessage("Usage: :[range]!command");
     return;
   }
-  int i;
-  int ocurrences = 0;
-  for(i = 0; i < E.numrows; i++){
-    erow *row = &E.row[i];
-    char *word = strstr(row->render, count);
-    if (word){
-      ocurrences++;
+
+  int in[2], out[2];
+  if (pipe2(in, O_CLOEXEC) == -1) {
+    editorSetStatusMessage("Can't filter: %s", strerror(errno));
+    return;
+  }
+  if (pipe2(out, O_CLOEXEC) == -1) {
+    close(in[0]);
+    close(in[1]);
+    editorSetStatusMessage("Can't filter: %s", strerror(errno));
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    // In a group of its own, so Ctrl-C stops whatever the shell started
+    setpgid(0, 0);
+    dup2(in[0], STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    // Messages of the command would land on the screen
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) dup2(null, STDERR_FILENO);
+    signal(SIGPIPE, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+  close(in[0]);
+  close(out[1]);
+  if (pid == -1) {
+    close(in[1]);
+    close(out[0]);
+    editorSetStatusMessage("Can't filter: %s", strerror(errno));
+    return;
+  }
+  setpgid(pid, pid);
+  fcntl(in[1], F_SETFL, O_NONBLOCK);
+  fcntl(out[0], F_SETFL, O_NONBLOCK);
+  // A filter that stops reading must not kill the editor
+  void (*oldpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+  struct filterInput input;
+  memset(&input, 0, sizeof(input));
+  input.at = start;
+  input.end = end;
+  input.cap = MVI_IO_CHUNK;
+  input.buf = malloc(input.cap);
+  size_t outcap = MVI_IO_CHUNK, outlen = 0;
+  char *outbuf = malloc(outcap);
+  erow *rows = NULL;
+  int nrows = 0, rowscap = 0, cancelled = 0, readerr = 0, j;
+
+  int infd = in[1], outfd = out[0];
+  while (outfd != -1) {
+    struct pollfd fds[3] = {
+      { outfd, POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 }, { infd, POLLOUT, 0 }
+    };
+    if (poll(fds, infd != -1 ? 3 : 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+    if (fds[1].revents & POLLIN) cancelled |= editorCommandKeys(pid);
+    if (infd != -1 && (fds[2].revents & (POLLOUT | POLLERR | POLLHUP))) {
+      int done = editorFilterWrite(&input, infd);
+      // Output of part of the rows must not replace all of them
+      if (done == -1) {
+        readerr = errno;
+        kill(-pid, SIGTERM);
+      }
+      if (done != 0) {
+        close(infd);
+        infd = -1;
+      }
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(outfd, outbuf + outlen, outcap - outlen);
+      if (n == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+      if (n <= 0) {
+        editorFilterRows(outbuf, outlen, 1, &rows, &nrows, &rowscap);
+        close(outfd);
+        outfd = -1;
+        break;
+      }
+      outlen += n;
+      size_t used = editorFilterRows(outbuf, outlen, 0, &rows, &nrows,
+                                     &rowscap);
+      memmove(outbuf, outbuf + used, outlen - used);
+      outlen -= used;
+      // A line longer than the buffer makes it grow
+      if (outlen == outcap) {
+        outcap *= 2;
+        outbuf = realloc(outbuf, outcap);
+      }
+    }
+  }
+  if (infd != -1) close(infd);
+  free(input.buf);
+  free(outbuf);
+  int status;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+  signal(SIGPIPE, oldpipe);
+
+  if (cancelled || readerr || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    for (j = 0; j < nrows; j++) editorFreeRow(&rows[j]);
+    free(rows);
+    if (cancelled)
+      editorSetStatusMessage("Filter cancelled");
+    else if (readerr)
+      editorSetStatusMessage("Can't filter: %s", strerror(readerr));
+    else if (WIFEXITED(status))
+      editorSetStatusMessage("%s: exit status %d", cmd, WEXITSTATUS(status));
+    else
+      editorSetStatusMessage("%s: killed by signal %d", cmd, WTERMSIG(status));
+    return;
+  }
+
+  // The old rows go to the undo record. They must stay readable after the
+  // file is saved, and within the budget, so only the spill file keeps them
+  erow *old = malloc(sizeof(erow) * (end - start ? end - start : 1));
+  for (j = start; j < end; j++) {
+    erow *row = &E.row[j];
+    editorWordsRemove(row);
+    if (row->chars == NULL ? !(row->flags & ROW_SPILLED) : E.memlimit != 0) {
+      editorRowLoad(row);
+      row->flags = (row->flags | ROW_MODIFIED) & ~ROW_SPILLED;
+      editorRowEvict(row);
+    }
+    E.rowbytes -= row->cost;
+    old[j - start] = *row;
+    row->chars = NULL;
+    row->cost = 0;
+  }
+  editorUndoClear();
+  editorReplaceRows(start, end - start, rows, nrows);
+  editorUndoAdd(start, nrows, old, end - start);
+  E.undo.dirty = E.dirty;
+  free(rows);
+
+  E.cy = start < E.numrows ? start : E.numrows;
+  E.cx = 0;
+  editorSetStatusMessage("%d lines filtered through %s, %d lines now",
+                         end - start, cmd, nrows);
+}
+
+// :!cmd without a range, like vi: runs cmd and shows its output over the
+// screen until a key is pressed. The buffer is left alone. Only the end of
+// the output is kept, what would be left on a terminal that scrolled
+void editorShellCommand(char *cmd) {
+  while (isspace((unsigned char)*cmd)) cmd++;
+  if (*cmd == '\0') {
+    editorSetStatusMessage("Usage: :[range]!command");
+    return;
+  }
+
+  int out[2];
+  if (pipe2(out, O_CLOEXEC) == -1) {
+    editorSetStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    setpgid(0, 0);
+    // The keys are the editor's, the command reads nothing
+    int null = open("/dev/null", O_RDONLY);
+    if (null != -1) dup2(null, STDIN_FILENO);
+    dup2(out[1], STDOUT_FILENO);
+    dup2(out[1], STDERR_FILENO);
+    signal(SIGPIPE, SIG_DFL);
+    execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+    _exit(127);
+  }
+  close(out[1]);
+  if (pid == -1) {
+    close(out[0]);
+    editorSetStatusMessage("Can't run %s: %s", cmd, strerror(errno));
+    return;
+  }
+  setpgid(pid, pid);
+
+  size_t cap = MVI_IO_CHUNK, len = 0;
+  char *buf = malloc(cap);
+  int cancelled = 0;
+  while (1) {
+    struct pollfd fds[2] = {
+      { out[0], POLLIN, 0 }, { STDIN_FILENO, POLLIN, 0 }
+    };
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+    if (fds[1].revents & POLLIN) cancelled |= editorCommandKeys(pid);
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      if (len == cap) {
+        memmove(buf, buf + cap / 2, cap - cap / 2);
+        len = cap - cap / 2;
+      }
+      ssize_t n = read(out[0], buf + len, cap - len);
+      if (n == -1 && errno == EINTR) continue;
+      if (n <= 0) break;
+      len += n;
+    }
+  }
+  close(out[0]);
+  int status;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+
+  // The last lines of the output, the bottom line of the screen is left for
+  // the prompt
+  int rows = E.screenrows + 1, lines = 0, j;
+  char *end = buf + len, *start = end;
+  if (end > buf && end[-1] == '\n') end--;
+  if (len > 0) {
+    lines = 1;
+    for (start = end; start > buf; start--) {
+      if (start[-1] != '\n') continue;
+      if (lines == rows) break;
+      lines++;
+    }
+  }
+  char *screen = malloc((size_t)rows * (E.screencols + 2) + 128);
+  int used = sprintf(screen, "\x1b[?25l\x1b[2J\x1b[H");
+  for (j = 0; j < lines; j++) {
+    char *nl = memchr(start, '\n', end - start);
+    if (nl == NULL) nl = end;
+    int col;
+    for (col = 0; col < nl - start && col < E.screencols; col++)
+      screen[used++] = start[col] == '\t' ? ' ' :
+                       IS_CTRL_BYTE(start[col]) ? '?' : start[col];
+    used += sprintf(screen + used, "\r\n");
+    start = nl + 1;
+  }
+  if (cancelled)
+    used += sprintf(screen + used, "[cancelled] ");
+  else if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+    used += sprintf(screen + used, "[exit status %d] ", WEXITSTATUS(status));
+  else if (WIFSIGNALED(status))
+    used += sprintf(screen + used, "[killed by signal %d] ", WTERMSIG(status));
+  used += sprintf(screen + used, "Press a key to continue\x1b[?25h");
+  write(STDOUT_FILENO, screen, used);
+  free(screen);
+  free(buf);
+  editorReadKey();
+  editorSetStatusMessage("");
+}
+
+/*** sort ***/
+
+// How :sort compares rows: by the text or the number at the start of a
+// whitespace separated field (1 for the whole row), optionally reversed
+struct sortSpec {
+  int numeric;
+  int reverse;
+  int field;
+  // Bytes every key starts with, like the date of a log
+  int common;
+};
+
+// A row being sorted. The first 8 bytes of its key after the ones every key
+// has in common are kept big-endian in an integer, or the number it starts
+// with, so most comparisons never look at the text of the rows
+typedef struct sortItem {
+  union {
+    uint64_t prefix;
+    double num;
+  } key;
+  int row;
+  int keyoff;
+} sortItem;
+
+// Per thread state: rows that are paged out are read into the buffers, they
+// are never paged in so the threads don't touch the memory budget
+struct sortCtx {
+  const struct sortSpec *spec;
+  char *buf[2];
+  int cap[2];
+};
+
+// Text of a row, read into buffer slot when it is paged out
+const char *editorSortText(struct sortCtx *ctx, int slot, erow *row) {
+  if (row->chars) return row->chars;
+  if (ctx->cap[slot] < row->size + 1) {
+    ctx->cap[slot] = 2 * (row->size + 1);
+    ctx->buf[slot] = realloc(ctx->buf[slot], ctx->cap[slot]);
+  }
+  editorRowRead(row, ctx->buf[slot]);
+  ctx->buf[slot][row->size] = '\0';
+  return ctx->buf[slot];
+}
+
+// Finds where the key of the item for row at starts, numeric keys are read
+// right away. Returns the text of the row
+const char *editorSortField(struct sortCtx *ctx, sortItem *it, int at) {
+  erow *row = &E.row[at];
+  const char *s = editorSortText(ctx, 0, row);
+  int j = 0, field;
+  for (field = 1; field < ctx->spec->field; field++) {
+    while (j < row->size && isspace((unsigned char)s[j])) j++;
+    while (j < row->size && !isspace((unsigned char)s[j])) j++;
+  }
+  if (ctx->spec->field > 1)
+    while (j < row->size && isspace((unsigned char)s[j])) j++;
+  it->row = at;
+  it->keyoff = j;
+  if (ctx->spec->numeric) {
+    it->key.num = strtod(s + j, NULL);
+    // Rows without a number come first, like rows with 0
+    if (it->key.num != it->key.num) it->key.num = 0;
+  }
+  return s;
+}
+
+// Keeps the 8 bytes of the key that follow the common ones
+void editorSortPrefix(struct sortCtx *ctx, sortItem *it) {
+  erow *row = &E.row[it->row];
+  const char *s = editorSortText(ctx, 0, row);
+  int j = it->keyoff + ctx->spec->common, k;
+  uint64_t prefix = 0;
+  for (k = 0; k < 8; k++) {
+    prefix <<= 8;
+    if (j + k < row->size) prefix |= (unsigned char)s[j + k];
+  }
+  it->key.prefix = prefix;
+}
+
+int editorSortCmp(struct sortCtx *ctx, const sortItem *a, const sortItem *b) {
+  int r;
+  if (ctx->spec->numeric) {
+    r = (a->key.num > b->key.num) - (a->key.num < b->key.num);
+  } else if (a->key.prefix != b->key.prefix) {
+    r = a->key.prefix < b->key.prefix ? -1 : 1;
+  } else {
+    erow *ra = &E.row[a->row], *rb = &E.row[b->row];
+    int la = ra->size - a->keyoff, lb = rb->size - b->keyoff;
+    // The common bytes and the 8 after them are known to be the same
+    int skip = ctx->spec->common;
+    if (la - skip >= 8 && lb - skip >= 8) skip += 8;
+    const char *ta = editorSortText(ctx, 0, ra) + a->keyoff;
+    const char *tb = editorSortText(ctx, 1, rb) + b->keyoff;
+    r = memcmp(ta + skip, tb + skip, (la < lb ? la : lb) - skip);
+    if (r == 0) r = (la > lb) - (la < lb);
+  }
+  return ctx->spec->reverse ? -r : r;
+}
+
+// Merges the sorted runs x and y into out, taking from x first on ties so the
+// sort is stable
+void editorSortMerge(struct sortCtx *ctx, sortItem *x, int nx, sortItem *y,
+                     int ny, sortItem *out) {
+  int i = 0, j = 0, k = 0;
+  while (i < nx && j < ny) {
+    if (editorSortCmp(ctx, &y[j], &x[i]) < 0) out[k++] = y[j++];
+    else out[k++] = x[i++];
+  }
+  memcpy(out + k, x + i, sizeof(sortItem) * (nx - i));
+  memcpy(out + k + nx - i, y + j, sizeof(sortItem) * (ny - j));
+}
+
+// Merge sort of n items, with tmp as scratch space of the same size
+void editorSortItems(struct sortCtx *ctx, sortItem *a, sortItem *tmp, int n) {
+  int i, j;
+  if (n <= 16) {
+    for (i = 1; i < n; i++) {
+      sortItem it = a[i];
+      for (j = i; j > 0 && editorSortCmp(ctx, &it, &a[j - 1]) < 0; j--)
+        a[j] = a[j - 1];
+      a[j] = it;
+    }
+    return;
+  }
+  int half = n / 2;
+  editorSortItems(ctx, a, tmp, half);
+  editorSortItems(ctx, a + half, tmp + half, n - half);
+  // Runs already in order, common in logs, are left as they are
+  if (editorSortCmp(ctx, &a[half - 1], &a[half]) <= 0) return;
+  editorSortMerge(ctx, a, half, a + half, n - half, tmp);
+  memcpy(a, tmp, sizeof(sortItem) * n);
+}
+
+// Work of one thread on its part of the rows: finding the keys and how much
+// they have in common with ref, then sorting them. Later, merges of two sorted
+// runs [lo, mid) and [mid, hi) into the other array
+struct sortJob {
+  struct sortCtx ctx;
+  sortItem *items, *tmp;
+  int base;
+  int lo, mid, hi;
+  const char *ref;
+  int reflen;
+  int common;
+};
+
+void *editorSortScan(void *arg) {
+  struct sortJob *job = arg;
+  int j, common = job->reflen;
+  for (j = job->lo; j < job->hi; j++) {
+    sortItem *it = &job->items[j];
+    const char *s = editorSortField(&job->ctx, it, job->base + j);
+    int len = E.row[it->row].size - it->keyoff;
+    if (len < common) common = len;
+    int k = 0;
+    while (k < common && s[it->keyoff + k] == job->ref[k]) k++;
+    common = k;
+  }
+  job->common = common;
+  return NULL;
+}
+
+void *editorSortPart(void *arg) {
+  struct sortJob *job = arg;
+  int j;
+  if (!job->ctx.spec->numeric)
+    for (j = job->lo; j < job->hi; j++)
+      editorSortPrefix(&job->ctx, &job->items[j]);
+  editorSortItems(&job->ctx, job->items + job->lo, job->tmp + job->lo,
+                  job->hi - job->lo);
+  return NULL;
+}
+
+void *editorSortJoin(void *arg) {
+  struct sortJob *job = arg;
+  editorSortMerge(&job->ctx, job->items + job->lo, job->mid - job->lo,
+                  job->items + job->mid, job->hi - job->mid,
+                  job->tmp + job->lo);
+  return NULL;
+}
+
+// Runs fn on every job, the first one on this thread
+void editorSortRun(struct sortJob *jobs, int njobs, void *(*fn)(void *)) {
+  pthread_t *threads = malloc(sizeof(pthread_t) * njobs);
+  int j;
+  for (j = 1; j < njobs; j++)
+    if (pthread_create(&threads[j], NULL, fn, &jobs[j])) die("pthread_create");
+  fn(&jobs[0]);
+  for (j = 1; j < njobs; j++) pthread_join(threads[j], NULL);
+  free(threads);
+}
+
+// Sorts rows [start, end). Only the erow entries move, the text stays where it
+// is. Each thread sorts a part of the rows, then the sorted parts are merged two
+// by two, in parallel too. The sort is one change for undo
+void editorSort(int start, int end, struct sortSpec *spec) {
+  int n = end - start, j;
+  if (n < 2) return;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > n / MVI_PARALLEL_MIN) nthreads = n / MVI_PARALLEL_MIN;
+  if (nthreads < 1) nthreads = 1;
+
+  sortItem *items = malloc(sizeof(sortItem) * n);
+  sortItem *tmp = malloc(sizeof(sortItem) * n);
+  struct sortJob *jobs = calloc(nthreads, sizeof(struct sortJob));
+  // The key of the first row is what the others are compared to, to find the
+  // bytes they all start with
+  struct sortCtx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.spec = spec;
+  const char *s = editorSortField(&ctx, &items[0], start);
+  int reflen = E.row[start].size - items[0].keyoff;
+  char *ref = malloc(reflen + 1);
+  memcpy(ref, s + items[0].keyoff, reflen);
+  free(ctx.buf[0]);
+
+  // Bounds of the sorted runs
+  int *bounds = malloc(sizeof(int) * (nthreads + 1));
+  for (j = 0; j <= nthreads; j++) bounds[j] = (long long)n * j / nthreads;
+  for (j = 0; j < nthreads; j++) {
+    jobs[j].ctx.spec = spec;
+    jobs[j].items = items;
+    jobs[j].tmp = tmp;
+    jobs[j].base = start;
+    jobs[j].lo = bounds[j];
+    jobs[j].hi = bounds[j + 1];
+    jobs[j].ref = ref;
+    jobs[j].reflen = spec->numeric ? 0 : reflen;
+  }
+  editorSortRun(jobs, nthreads, editorSortScan);
+  spec->common = reflen;
+  for (j = 0; j < nthreads; j++)
+    if (jobs[j].common < spec->common) spec->common = jobs[j].common;
+  editorSortRun(jobs, nthreads, editorSortPart);
+
+  int runs = nthreads;
+  while (runs > 1) {
+    int pairs = runs / 2;
+    for (j = 0; j < pairs; j++) {
+      jobs[j].items = items;
+      jobs[j].tmp = tmp;
+      jobs[j].lo = bounds[2 * j];
+      jobs[j].mid = bounds[2 * j + 1];
+      jobs[j].hi = bounds[2 * j + 2];
+    }
+    editorSortRun(jobs, pairs, editorSortJoin);
+    // A run left without a pair is copied as it is
+    if (runs % 2)
+      memcpy(tmp + bounds[runs - 1], items + bounds[runs - 1],
+             sizeof(sortItem) * (bounds[runs] - bounds[runs - 1]));
+    for (j = 0; j <= pairs; j++)
+      bounds[j] = bounds[2 * j < runs ? 2 * j : runs];
+    bounds[(runs + 1) / 2] = n;
+    runs = (runs + 1) / 2;
+    sortItem *swap = items;
+    items = tmp;
+    tmp = swap;
+  }
+
+  // The rows are gathered back in a random order from a copy, the next ones
+  // are fetched ahead so the cache misses overlap. The copy then becomes the
+  // undo record, sharing the text of the rows in their old order
+  erow *old = malloc(sizeof(erow) * n);
+  memcpy(old, &E.row[start], sizeof(erow) * n);
+  for (j = 0; j < n; j++) {
+    if (j + 16 < n) __builtin_prefetch(&old[items[j + 16].row - start]);
+    E.row[start + j] = old[items[j].row - start];
+  }
+  for (j = 0; j < n; j++) {
+    erow row = old[j];
+    editorRowShare(&old[j], &row);
+  }
+  editorUndoClear();
+  editorUndoAdd(start, n, old, n);
+  E.dirty++;
+  E.undo.dirty = E.dirty;
+  editorDirtyRows(start, n, n);
+
+  for (j = 0; j < nthreads; j++) {
+    free(jobs[j].ctx.buf[0]);
+    free(jobs[j].ctx.buf[1]);
+  }
+  free(jobs);
+  free(ref);
+  free(bounds);
+  free(items);
+  free(tmp);
+  editorSetStatusMessage("%d lines sorted", n);
+}
+
+// Removes the rows equal to the row before them in [start, end), as one change
+// for undo
+void editorUniq(int start, int end) {
+  if (end - start < 2) return;
+  struct sortCtx ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  int n = end - start, kept = 1, j;
+  erow *old = malloc(sizeof(erow) * n);
+  editorRowShare(&old[0], &E.row[start]);
+  for (j = 1; j < n; j++) {
+    erow *row = &E.row[start + j], *prev = &E.row[start + kept - 1];
+    editorRowShare(&old[j], row);
+    if (row->size == prev->size &&
+        memcmp(editorSortText(&ctx, 0, row), editorSortText(&ctx, 1, prev),
+               row->size) == 0) {
+      editorWordsRemove(row);
+      editorFreeRow(row);
+    } else {
+      E.row[start + kept++] = *row;
+    }
+  }
+  free(ctx.buf[0]);
+  free(ctx.buf[1]);
+  if (kept == n) {
+    for (j = 0; j < n; j++)
+      if (old[j].chars) editorTextFree(old[j].chars);
+    free(old);
+    editorSetStatusMessage("No duplicate lines");
+    return;
+  }
+  memmove(&E.row[start + kept], &E.row[end],
+          sizeof(erow) * (E.numrows - end));
+  E.numrows -= n - kept;
+  editorUndoClear();
+  editorUndoAdd(start, kept, old, n);
+  E.dirty++;
+  E.undo.dirty = E.dirty;
+  editorDirtyRows(start, n, kept);
+
+  if (E.cy >= E.numrows) E.cy = E.numrows > 0 ? E.numrows - 1 : 0;
+  if (E.cy < E.numrows && E.cx > E.row[E.cy].size) E.cx = E.row[E.cy].size;
+  editorSetStatusMessage("%d duplicate lines removed", n - kept);
+}
+
+// Reads the options of :sort: n for numbers, r (or sort!) to reverse and k
+// followed by the field to compare from. Returns -1 on an unknown option
+int editorParseSort(char *p, struct sortSpec *spec) {
+  memset(spec, 0, sizeof(*spec));
+  spec->field = 1;
+  if (*p == '!') {
+    spec->reverse = 1;
+    p++;
+  }
+  while (*p) {
+    if (*p == 'n') {
+      spec->numeric = 1;
+    } else if (*p == 'r') {
+      spec->reverse = 1;
+    } else if (*p == 'k') {
+      p++;
+      while (*p == ' ') p++;
+      if (!isdigit((unsigned char)*p)) return -1;
+      spec->field = strtol(p, &p, 10);
+      if (spec->field < 1) return -1;
+      continue;
+    } else if (*p != ' ') {
+      return -1;
     }
+    p++;
   }
-  editorSetStatusMessage("Your word was %d times", ocurrences);
+  return 0;
 }
 
-// Loop through all the rows of the file, and if a row contains their query string,
-// move the cursor to the match
-void editorFindCallback(char *query, int key) {
-  static int last_match = -1;
-  static int direction = 1;
+// Reads one line address: a number, . for the cursor line or $ for the last
+// line. Returns -1 if there is none
+int editorParseAddress(char **p) {
+  if (**p == '.') {
+    (*p)++;
+    return E.cy;
+  }
+  if (**p == '$') {
+    (*p)++;
+    return E.numrows - 1;
+  }
+  if (isdigit((unsigned char)**p)) return strtol(*p, p, 10) - 1;
+  return -1;
+}
 
-  if (key == '\r' || key == '\x1b') {
-    last_match = -1;
-    direction = 1;
+// Reads a range of lines (%, N or N,M) into [start, end). Without a range it
+// is the cursor line
+void editorParseRange(char **p, int *start, int *end) {
+  if (**p == '%') {
+    (*p)++;
+    *start = 0;
+    *end = E.numrows;
     return;
-  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    direction = -1;
-  } else {
-    last_match = -1;
-    direction = 1;
   }
-
-  if (last_match == -1) direction = 1;
-  int current = last_match;
-  int i;
-  for (i = 0; i < E.numrows; i++) {
-    current += direction;
-    if (current == -1) current = E.numrows - 1;
-    else if (current == E.numrows) current = 0;
-    erow *row = &E.row[current];
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = current;
-      E.cy = current;
-      E.cx = editorRowRxToCx(row, match - row->render);
-      E.rowoff = E.numrows;
-      break;
-    }
+  int first = editorParseAddress(p);
+  int last = first;
+  if (first != -1 && **p == ',') {
+    (*p)++;
+    last = editorParseAddress(p);
+    if (last == -1) last = first;
+  }
+  if (first == -1) first = last = E.cy;
+  if (first > last) {
+    int tmp = first;
+    first = last;
+    last = tmp;
   }
+  if (first < 0) first = 0;
+  *start = first;
+  *end = last + 1 > E.numrows ? E.numrows : last + 1;
 }
 
-void editorFind(char *query) {
-  int saved_cx = E.cx;
-  int saved_cy = E.cy;
-  int saved_coloff = E.coloff;
-  int saved_rowoff = E.rowoff;
+// Cuts the next part of s/pat/rep/ at the delimiter, \ escapes the delimiter
+// and itself
+char *editorSplitPattern(char **p, char delim) {
+  char *start = *p, *dst = *p;
+  while (**p && **p != delim) {
+    if (**p == '\\' && ((*p)[1] == delim || (*p)[1] == '\\')) (*p)++;
+    *dst++ = *(*p)++;
+  }
+  if (**p) (*p)++;
+  *dst = '\0';
+  return start;
+}
 
-  while(1) {
-    editorSetStatusMessage("Searching (navigate with arrows): %s", query);
-    editorRefreshScreen();
-    int c = editorReadKey();
-    if (c == '\x1b' || c == '\r') {
-      // Cancels prompts
-      editorSetStatusMessage("");
-      return;
+// Handles the commands that take a line range, like :%s/pat/rep/g.
+// Returns 0 if the line is not one of them
+int editorProcessRangeCommand(char *line) {
+  char *p = line;
+  int start, end;
+  if (E.hex.active) return 0;
+  editorParseRange(&p, &start, &end);
+  // Sort and uniq work on the whole file unless given a range
+  int ranged = p != line;
+  if (strncmp(p, "sort", 4) == 0 &&
+      (p[4] == '\0' || p[4] == ' ' || p[4] == '!')) {
+    struct sortSpec spec;
+    if (editorParseSort(p + 4, &spec) == -1) {
+      editorSetStatusMessage("Usage: :[range]sort[!] [n] [r] [k field]");
+      return 1;
     }
-    editorFindCallback(query, c);
+    if (!ranged) {
+      start = 0;
+      end = E.numrows;
+    }
+    editorSort(start, end, &spec);
+    return 1;
   }
-
-  if (query) {
-    free(query);
-  } else {
-    E.cx = saved_cx;
-    E.cy = saved_cy;
-    E.coloff = saved_coloff;
-    E.rowoff = saved_rowoff;
+  if (strcmp(p, "uniq") == 0) {
+    if (!ranged) {
+      start = 0;
+      end = E.numrows;
+    }
+    editorUniq(start, end);
+    return 1;
   }
-}
-
-void editorGoToLine(int line) {
-  if (line > E.numrows) line = E.numrows -1;
-  E.cy = line;
+  // Substitute: s followed by a delimiter, :s <text> is still search
+  if (p[0] == 's' && p[1] && !isalnum((unsigned char)p[1]) &&
+      !isspace((unsigned char)p[1])) {
+    char delim = p[1];
+    p += 2;
+    char *pat = editorSplitPattern(&p, delim);
+    char *rep = editorSplitPattern(&p, delim);
+    editorSubstitute(start, end, pat, rep, strchr(p, 'g') != NULL);
+    return 1;
+  }
+  // Filter: the rows are replaced by the output of the command. Without a
+  // range the command only runs
+  if (p[0] == '!') {
+    if (ranged) editorFilter(start, end, p + 1);
+    else editorShellCommand(p + 1);
+    return 1;
+  }
+  return 0;
 }
 
 // We need to make a buffer for the text that is being written so we dont do small writes but one big write
@@ -632,21 +4423,94 @@ void editorDrawRows(struct abuf *ab) {
         abAppend(ab, "~", 1);
       }
     } else {
+      // In diff mode the rows that differ from the file are colored. The
+      // marks are from the last idle moment and may not cover new rows yet
+      if (E.diff.active && filerow < E.diff.numrows) {
+        int mark = E.diff.marks[filerow];
+        if (mark & DIFF_ADDED) abAppend(ab, "\x1b[42;30m", 8);
+        if (mark & DIFF_CHANGED) abAppend(ab, "\x1b[43;30m", 8);
+        if (mark & DIFF_DELETED) abAppend(ab, "\x1b[4;31m", 7);
+      }
+      editorRowLoad(&E.row[filerow]);
       int len = E.row[filerow].rsize - E.coloff;
       if (len < 0) len = 0;
       if (len > E.screencols) len = E.screencols;
-      abAppend(ab, &E.row[filerow].render[E.coloff], len);
+      abAppend(ab, editorRowRender(&E.row[filerow]) + E.coloff, len);
     }
     // Erases the whole line with help of the k command erase in line
     abAppend(ab, "\x1b[K", 3);
+    if (E.diff.active) abAppend(ab, "\x1b[m", 3);
     abAppend(ab, "\r\n", 2);
   }
 }
 
+// Keeps the cursor line of the hex view on the screen, and places the
+// terminal cursor on the half of the byte being edited
+void editorHexScroll() {
+  // The file may have been truncated or extended by someone else
+  off_t size = E.hex.size;
+  editorHexStat();
+  if (E.hex.size != size) editorHexGoTo(E.hex.cursor);
+  off_t line = E.hex.cursor / MVI_HEX_WIDTH;
+  if (line < E.hex.top) E.hex.top = line;
+  if (line >= E.hex.top + E.screenrows) E.hex.top = line - E.screenrows + 1;
+  int col = E.hex.cursor % MVI_HEX_WIDTH;
+  // Lines of big files don't fit in E.cy, only the row on the screen is set
+  E.rowoff = 0;
+  E.cy = line - E.hex.top;
+  E.coloff = 0;
+  E.rx = 10 + col * 3 + (col >= MVI_HEX_WIDTH / 2) + E.hex.nibble;
+}
+
+// Draws offset, hex and ASCII columns of the lines on the screen, reading
+// only their bytes. Changed bytes are highlighted
+void editorHexDrawRows(struct abuf *ab) {
+  int y;
+  for (y = 0; y < E.screenrows; y++) {
+    off_t off = (E.hex.top + y) * MVI_HEX_WIDTH;
+    if (off >= E.hex.size && !(off == 0 && y == 0)) {
+      abAppend(ab, "~\x1b[K\r\n", 6);
+      continue;
+    }
+    char cell[32];
+    int width = 0, i, changed, len;
+    len = snprintf(cell, sizeof(cell), "%08llx  ", (unsigned long long)off);
+    // Cells that don't fit in the terminal are left out
+    if (width + len <= E.screencols) abAppend(ab, cell, len);
+    width += len;
+    for (i = 0; i < MVI_HEX_WIDTH; i++) {
+      int byte = editorHexByte(off + i, &changed);
+      len = byte == -1 ? snprintf(cell, sizeof(cell), "   ")
+                       : snprintf(cell, sizeof(cell), "%02x ", byte);
+      if (i == MVI_HEX_WIDTH / 2 - 1) cell[len++] = ' ';
+      if (width + len <= E.screencols) {
+        if (changed) abAppend(ab, "\x1b[43;30m", 8);
+        abAppend(ab, cell, 2);
+        if (changed) abAppend(ab, "\x1b[m", 3);
+        abAppend(ab, cell + 2, len - 2);
+      }
+      width += len;
+    }
+    if (width + 2 <= E.screencols) abAppend(ab, " |", 2);
+    width += 2;
+    for (i = 0; i < MVI_HEX_WIDTH; i++) {
+      int byte = editorHexByte(off + i, &changed);
+      if (byte == -1 || width + 1 > E.screencols) break;
+      char c = isprint(byte) ? byte : '.';
+      if (changed) abAppend(ab, "\x1b[43;30m", 8);
+      abAppend(ab, &c, 1);
+      if (changed) abAppend(ab, "\x1b[m", 3);
+      width++;
+    }
+    if (width + 1 <= E.screencols) abAppend(ab, "|", 1);
+    abAppend(ab, "\x1b[K\r\n", 5);
+  }
+}
+
 // Shows information of the file and line the cursor is at
 void editorDrawStatusBar(struct abuf *ab) {
   abAppend(ab, "\x1b[7m", 4);
-  char status[80], rstatus[80], mode[10];
+  char status[80], rstatus[80], mode[20];
 
   switch (E.mode) {
   case MODE_INSERT:
@@ -656,17 +4520,29 @@ void editorDrawStatusBar(struct abuf *ab) {
     strcpy(mode, "<NORMAL>");
     break;
   }
+  if (E.recording != -1)
+    snprintf(mode + 8, sizeof(mode) - 8, " rec @%c", 'a' + E.recording);
 
-  int len = snprintf(
-      status,
-      sizeof(status),
-      "%.20s %.20s - %d lines %s",
-      mode,
-      E.filename ? E.filename : "[No Name]", E.numrows,
-      E.dirty ? "(modified)" : "");
+  int len, rlen;
+  if (E.hex.active) {
+    len = snprintf(status, sizeof(status), "%.20s %.20s - %llu bytes hex %s",
+                   mode, E.filename, (unsigned long long)E.hex.size,
+                   E.dirty ? "(modified)" : "");
+    rlen = snprintf(rstatus, sizeof(rstatus), "0x%llx/0x%llx",
+                    (unsigned long long)E.hex.cursor,
+                    (unsigned long long)E.hex.size);
+  } else {
+    len = snprintf(
+        status,
+        sizeof(status),
+        "%.20s %.20s - %d lines %s",
+        mode,
+        E.filename ? E.filename : "[No Name]", E.numrows,
+        E.dirty ? "(modified)" : "");
 
-  int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-    E.cy + 1, E.numrows);
+    rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
+      E.cy + 1, E.numrows);
+  }
 
   if (len > E.screencols) len = E.screencols;
   abAppend(ab, status, len);
@@ -695,14 +4571,17 @@ void editorDrawMessageBar(struct abuf *ab) {
 // Clears the screen when we render the editors screen
 // The second write function is to reposition the cursor to the top left of the editor
 void editorRefreshScreen() {
-  editorScroll();
+  if (E.replaying) return;
+  if (E.hex.active) editorHexScroll();
+  else editorScroll();
 
   struct abuf ab = ABUF_INIT;
 
   abAppend(&ab, "\x1b[?25l", 6);
   abAppend(&ab, "\x1b[H", 3);
 
-  editorDrawRows(&ab);
+  if (E.hex.active) editorHexDrawRows(&ab);
+  else editorDrawRows(&ab);
   editorDrawStatusBar(&ab);
   editorDrawMessageBar(&ab);
 
@@ -810,7 +4689,15 @@ void editorMoveCursor(int key) {
 }
 
 void editorProcessInsertKeypress(int c) {
+  // Any other key accepts the completion
+  if (c != CTRL_KEY('n') && c != CTRL_KEY('p')) editorCompleteEnd();
   switch (c) {
+    // Complete the word before the cursor
+    case CTRL_KEY('n'):
+    case CTRL_KEY('p'):
+      editorComplete(c == CTRL_KEY('n') ? 1 : -1);
+      break;
+
     // Enter (CR)
     case '\r':
       editorInsertNewline();
@@ -869,6 +4756,24 @@ void editorProcessInsertKeypress(int c) {
   }
 }
 
+// Changes the tab stop with :set ts=N and renders the rows in memory again
+void editorSetOption(char *option) {
+  if (option == NULL ||
+      (strncmp(option, "ts=", 3) != 0 && strncmp(option, "tabstop=", 8) != 0)) {
+    editorSetStatusMessage("Unknown option: %s", option ? option : "");
+    return;
+  }
+  int ts = atoi(strchr(option, '=') + 1);
+  if (ts < 1 || ts > 64) {
+    editorSetStatusMessage("Invalid tab stop: %d", ts);
+    return;
+  }
+  E.tabstop = ts;
+  int j;
+  for (j = 0; j < E.numrows; j++)
+    if (E.row[j].chars) editorUpdateRow(&E.row[j]);
+}
+
 void editorProcessCommand(char *command, char *option){
   static int quit_times = MVI_QUIT_TIMES;
   // Quit
@@ -877,7 +4782,7 @@ void editorProcessCommand(char *command, char *option){
         editorSetStatusMessage("Wait! File has unsaved changes. Press :q! to force quit without saving.", quit_times);
         char* save = editorPrompt("You have unsaved changes. Do you want to save? (y | n): %s", NULL);
         if (strcmp(save, "y") == 0 || strcmp(save, "Y") == 0) {
-          editorSave();
+          editorSave(0);
         } else if (strcmp(save, "n") == 0 || strcmp(save, "N") == 0) {
           write(STDOUT_FILENO, "\x1b[2J", 4);
           write(STDOUT_FILENO, "\x1b[H", 3);
@@ -895,28 +4800,51 @@ void editorProcessCommand(char *command, char *option){
       exit(0);
   }
   // Write
-  else if (strcmp(command, "w") == 0) {
-    editorSave();
+  else if (strcmp(command, "w") == 0 || strcmp(command, "w!") == 0) {
+    editorSave(command[1] == '!');
   }
   //Write and quit
   else if (strcmp(command, "wq") == 0) {
-    editorSave();
-    write(STDOUT_FILENO, "\x1b[2J", 4);
-    write(STDOUT_FILENO, "\x1b[H", 3);
-    exit(0);
+    if (editorSave(0) == 0) {
+      write(STDOUT_FILENO, "\x1b[2J", 4);
+      write(STDOUT_FILENO, "\x1b[H", 3);
+      exit(0);
+    }
+  }
+  // Reload the file from disk
+  else if (strcmp(command, "e") == 0 || strcmp(command, "e!") == 0) {
+    if (E.filename == NULL) {
+      editorSetStatusMessage("No file name");
+    } else if (E.dirty && command[1] != '!') {
+      editorSetStatusMessage("File has unsaved changes. Use :e! to reload anyway");
+    } else {
+      editorReload();
+    }
   }
   // Find text
   else if (strcmp(command, "s") == 0) {
     editorFind(option);
   }
-  // Go to line
+  // Go to line, or to a byte offset in the hex view
   else if (strcmp(command, "n") == 0) {
-    int line = atoi(option);
-    editorGoToLine(line - 1);
+    if (E.hex.active) {
+      editorHexGoTo(option ? strtoll(option, NULL, 0) : 0);
+    } else {
+      int line = atoi(option);
+      editorGoToLine(line - 1);
+    }
   }
   else if (strcmp(command, "f") == 0) {
     countOcurrences(option);
   }
+  // Options, only the tab stop for now
+  else if (strcmp(command, "set") == 0) {
+    editorSetOption(option);
+  }
+  // Diff against the file on disk
+  else if (strcmp(command, "diff") == 0 || strcmp(command, "diffoff") == 0) {
+    editorDiffToggle(command[4] == '\0');
+  }
   quit_times = MVI_QUIT_TIMES;
 }
 
@@ -924,12 +4852,73 @@ void editorProcessNormalKeypress(int c) {
   static int quit_times = MVI_QUIT_TIMES;
   char* command = NULL;
 
+  // Count for the next command
+  if ((c >= '1' && c <= '9') || (c == '0' && E.count > 0)) {
+    E.count = E.count * 10 + (c - '0');
+    return;
+  }
+  // Register for the next yank, delete or put, the count is kept
+  if (c == '"') {
+    int reg = editorReadKey();
+    if (reg >= 'a' && reg <= 'z') E.yankreg = reg - 'a';
+    return;
+  }
+  int count = E.count ? E.count : 1;
+  E.count = 0;
+
   switch (c) {
+    // Yank and delete count rows
+    case 'y':
+    case 'd':
+      if (editorReadKey() != c || E.cy >= E.numrows) break;
+      if (c == 'd') {
+        editorDeleteRows(E.cy, count);
+      } else {
+        if (count > E.numrows - E.cy) count = E.numrows - E.cy;
+        editorYank(E.cy, count);
+        if (count > 1) editorSetStatusMessage("%d lines yanked", count);
+      }
+      break;
+
+    // Put the register after or before the row
+    case 'p':
+    case 'P':
+      editorPut(c == 'P', count);
+      break;
+
     // Quit
     case 58:
-      command = strtok(editorPrompt(":%s", NULL), " ");
-      char* options = strtok(NULL, " ");
-      editorProcessCommand(command, options);
+      {
+        char *line = editorPrompt(":%s", NULL);
+        if (line == NULL) break;
+        if (!editorProcessRangeCommand(line)) {
+          command = strtok(line, " ");
+          char* options = strtok(NULL, " ");
+          if (command) editorProcessCommand(command, options);
+        }
+        free(line);
+      }
+      break;
+
+    // Undo the last bulk change
+    case 'u':
+      editorUndo();
+      break;
+
+    // Record a macro
+    case 'q':
+      if (!E.replaying) editorMacroRecord();
+      break;
+
+    // Replay a macro count times
+    case '@':
+      editorMacroReplay(count);
+      break;
+
+    // Next and previous diff hunk
+    case ']':
+    case '[':
+      if (editorReadKey() == 'c') editorDiffJump(c == ']' ? 1 : -1);
       break;
 
     case HOME_KEY:
@@ -985,15 +4974,87 @@ void editorProcessNormalKeypress(int c) {
       break;
   }
 
+  E.yankreg = -1;
   quit_times = MVI_QUIT_TIMES;
 }
 
+// Keys of the hex view: the arrows move by bytes and lines, a count before
+// them in normal mode moves that many times. In insert mode hex digits
+// overwrite the byte under the cursor one half at a time
+void editorHexKeypress(int c) {
+  // Counts and the commands that take them are read as in normal mode
+  if (E.mode == MODE_NORMAL &&
+      ((c >= '0' && c <= '9') || c == ':' || c == 'i' || c == 'I' ||
+       c == 'q' || c == '@')) {
+    editorProcessNormalKeypress(c);
+    return;
+  }
+  off_t count = E.count ? E.count : 1;
+  E.count = 0;
+  off_t page = (off_t)E.screenrows * MVI_HEX_WIDTH;
+  off_t lines;
+  switch (c) {
+    case ARROW_LEFT:
+      editorHexGoTo(E.hex.cursor - count);
+      break;
+    case ARROW_RIGHT:
+      editorHexGoTo(E.hex.cursor + count);
+      break;
+    case ARROW_UP:
+      lines = E.hex.cursor / MVI_HEX_WIDTH;
+      if (lines > count) lines = count;
+      editorHexGoTo(E.hex.cursor - lines * MVI_HEX_WIDTH);
+      break;
+    case ARROW_DOWN:
+      lines = E.hex.size ? (E.hex.size - 1 - E.hex.cursor) / MVI_HEX_WIDTH : 0;
+      if (lines > count) lines = count;
+      editorHexGoTo(E.hex.cursor + lines * MVI_HEX_WIDTH);
+      break;
+    case PAGE_UP:
+      editorHexGoTo(E.hex.cursor - page * count);
+      break;
+    case PAGE_DOWN:
+      editorHexGoTo(E.hex.cursor + page * count);
+      break;
+    case HOME_KEY:
+      editorHexGoTo(E.hex.cursor - E.hex.cursor % MVI_HEX_WIDTH);
+      break;
+    case END_KEY:
+      editorHexGoTo(E.hex.cursor - E.hex.cursor % MVI_HEX_WIDTH +
+                    MVI_HEX_WIDTH - 1);
+      break;
+    case CTRL_KEY('l'):
+    case '\x1b':
+      E.mode = MODE_NORMAL;
+      E.hex.nibble = 0;
+      break;
+    default:
+      if (E.mode == MODE_INSERT && isxdigit(c) && E.hex.size > 0) {
+        int changed;
+        int digit = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+        int byte = editorHexByte(E.hex.cursor, &changed);
+        if (E.hex.nibble) byte = (byte & 0xf0) | digit;
+        else byte = (byte & 0x0f) | (digit << 4);
+        editorHexSet(E.hex.cursor, byte);
+        if (E.hex.nibble) editorHexGoTo(E.hex.cursor + 1);
+        else E.hex.nibble = 1;
+      } else if (E.mode == MODE_NORMAL && c == 'u') {
+        editorSetStatusMessage("No undo in the hex view, :e! drops the changes");
+      }
+      break;
+  }
+}
+
 // Waits for a keypress and then handles the key press its used to map different key 
 // combinations and special keys to different functions of the vim, and also to insert and 
 // printable keys to the edited text
 void editorProcessKeypress() {
   int c = editorReadKey();
 
+  if (E.hex.active) {
+    editorHexKeypress(c);
+    return;
+  }
   switch (E.mode) {
   case MODE_INSERT:
     editorProcessInsertKeypress(c);
@@ -1005,6 +5066,366 @@ void editorProcessKeypress() {
 
 }
 
+/*** server ***/
+
+// The server listens in $XDG_RUNTIME_DIR/mini-vi, or in /tmp/mini-vi-<uid>
+// when there is no runtime directory. The directory is made when create is
+// set. Returns -1 when it is missing or other users could write to it
+int editorSocketPath(struct sockaddr_un *addr, int create) {
+  const char *runtime = getenv("XDG_RUNTIME_DIR");
+  char dir[PATH_MAX];
+  if (runtime && *runtime)
+    snprintf(dir, sizeof(dir), "%s/mini-vi", runtime);
+  else
+    snprintf(dir, sizeof(dir), "/tmp/mini-vi-%d", (int)getuid());
+  if (create && mkdir(dir, 0700) == -1 && errno != EEXIST) return -1;
+
+  // Anyone can make a directory with that name in /tmp first
+  struct stat st;
+  if (lstat(dir, &st) == -1) return -1;
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+    errno = EACCES;
+    return -1;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/sock", dir) >=
+      (int)sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  return 0;
+}
+
+// Whether path is a socket of this user, the only kind of file the server
+// removes or the client connects to
+int editorOwnSocket(const char *path) {
+  struct stat st;
+  return lstat(path, &st) == 0 && S_ISSOCK(st.st_mode) &&
+         st.st_uid == getuid();
+}
+
+// Whether the process at the other end of the socket runs as this user
+int editorPeerIsUser(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+         cred.uid == getuid();
+}
+
+// Sends a file descriptor together with the hello of its client
+int editorSendClient(int sock, int fd, struct clientHello *hello) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { hello, sizeof(*hello) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(control, 0, sizeof(control));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  return sendmsg(sock, &msg, 0) == sizeof(*hello) ? 0 : -1;
+}
+
+// Receives a client sent by editorSendClient. Returns -1 when the server is
+// gone
+int editorRecvClient(int sock, struct clientHello *hello) {
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = { hello, sizeof(*hello) };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n;
+  while ((n = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR);
+  if (n != sizeof(*hello)) return -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) return -1;
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
+
+// Runs the editor until it quits
+void editorLoop() {
+  while (1) {
+    editorRefreshScreen();
+    editorProcessKeypress();
+  }
+}
+
+// Called when a session of the server exits
+void editorSessionEnd() {
+  __atomic_sub_fetch(E.sessions, 1, __ATOMIC_SEQ_CST);
+}
+
+// Keeps one buffer loaded for the server. Each client gets a forked copy of
+// it, so opening the file again costs no reading and clients never share
+// their changes until they save. The buffer is read again when a client saved
+// the file
+void editorKeep(char *path, int sock) {
+  signal(SIGCHLD, SIG_IGN);
+  if (access(path, F_OK) == 0) editorOpen(path);
+  else E.filename = strdup(path);
+  E.sessions = mmap(NULL, sizeof(int), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (E.sessions == MAP_FAILED) die("mmap");
+  *E.sessions = 0;
+
+  struct clientHello hello;
+  int fd;
+  while ((fd = editorRecvClient(sock, &hello)) != -1) {
+    if (E.filestat.st_ino == 0 ? access(path, F_OK) == 0 : editorFileChanged()) {
+      // Rows paged out may point to bytes that were written over
+      if (E.srcfd == -1 && E.filestat.st_ino != 0) editorReload();
+      else editorOpen(path);
+    }
+
+    __atomic_add_fetch(E.sessions, 1, __ATOMIC_SEQ_CST);
+    pid_t pid = fork();
+    if (pid == -1) editorSessionEnd();
+    if (pid == 0) {
+      atexit(editorSessionEnd);
+      close(sock);
+      dup2(fd, STDIN_FILENO);
+
+      dup2(fd, STDOUT_FILENO);
+      close(fd);
+      // Reads time out like the terminal in raw mode does
+      struct timeval tv = { 0, 100000 };
+      setsockopt(STDIN_FILENO, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      signal(SIGCHLD, SIG_DFL);
+      signal(SIGPIPE, SIG_DFL);
+      E.session = 1;
+      E.screenrows = hello.rows - 2;
+      E.screencols = hello.cols;
+      // Rows paged out by this client go to its own spill file
+      E.spillfd = -1;
+      E.spilllen = 0;
+      editorSetStatusMessage("HELP: i for insert mode | :q to quit | :w to save | :s <token> to search");
+      editorLoop();
+    }
+    close(fd);
+  }
+  exit(0);
+}
+
+// A client of the server that connected and is still sending its hello and
+// the path of its file
+struct pendingClient {
+  int fd;
+  time_t since;
+  size_t got;
+  struct clientHello hello;
+  char path[PATH_MAX];
+};
+
+// Reads what arrived of the hello of a client without waiting for the rest.
+// Returns 1 when the hello and the path are complete, 0 if they aren't yet
+// and -1 when the client must be dropped
+int editorReadHello(struct pendingClient *pc) {
+  while (1) {
+    char *p;
+    size_t want;
+    if (pc->got < sizeof(pc->hello)) {
+      p = (char *)&pc->hello + pc->got;
+      want = sizeof(pc->hello) - pc->got;
+    } else {
+      size_t have = pc->got - sizeof(pc->hello);
+      if (have == pc->hello.pathlen) {
+        pc->path[have] = '\0';
+        return 1;
+      }
+      p = pc->path + have;
+      want = pc->hello.pathlen - have;
+    }
+    ssize_t n = read(pc->fd, p, want);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) return -1;
+    pc->got += n;
+    struct clientHello *h = &pc->hello;
+    if (pc->got == sizeof(*h) &&
+        (memcmp(h->magic, MVI_SERVER_MAGIC, sizeof(h->magic)) != 0 ||
+         h->pathlen == 0 || h->pathlen >= PATH_MAX || h->rows < 3 ||
+         h->cols == 0))
+      return -1;
+  }
+}
+
+// Accepts clients and hands each one to the process that keeps its file,
+// starting it the first time the file is asked for. Only clients of the same
+// user are served, and their hellos are read as they arrive so a slow client
+// doesn't hold up the others
+void editorServe() {
+  struct sockaddr_un addr;
+  if (editorSocketPath(&addr, 1) == -1) die("socket directory");
+  int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (lfd == -1) die("socket");
+  // The socket of a server that is gone is replaced, nothing else is
+  if (editorOwnSocket(addr.sun_path)) unlink(addr.sun_path);
+  if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == -1) die("bind");
+  if (listen(lfd, 16) == -1) die("listen");
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "mini-vi: serving on %s\n", addr.sun_path);
+
+  struct keeper {
+    char *path;
+    int sock;
+  } *keepers = NULL;
+  int nkeepers = 0;
+  struct pendingClient *pending = NULL;
+  struct pollfd *fds = NULL;
+  int npending = 0, i;
+
+  while (1) {
+    fds = realloc(fds, sizeof(*fds) * (npending + 1));
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    for (i = 0; i < npending; i++) {
+      fds[i + 1].fd = pending[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+    // Wakes up every second to drop the clients that are too slow
+    if (poll(fds, npending + 1, npending ? 1000 : -1) == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+      if (fd != -1 && !editorPeerIsUser(fd)) {
+        close(fd);
+      } else if (fd != -1) {
+        pending = realloc(pending, sizeof(*pending) * (npending + 1));
+        memset(&pending[npending], 0, sizeof(*pending));
+        pending[npending].fd = fd;
+        pending[npending].since = time(NULL);
+        npending++;
+      }
+    }
+
+    // Removing a client moves the last one to its place, so they are checked
+    // from the last one
+    for (i = npending - 1; i >= 0; i--) {
+      struct pendingClient *pc = &pending[i];
+      int ready = editorReadHello(pc);
+      // A client that doesn't say hello in time is dropped
+      if (ready == 0 && time(NULL) - pc->since < 2) continue;
+      int fd = pc->fd;
+      if (ready == 1) {
+        // The session reads the socket like a terminal, blocking
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        int j, tries;
+        for (tries = 0; tries < 2; tries++) {
+          for (j = 0; j < nkeepers; j++)
+            if (strcmp(keepers[j].path, pc->path) == 0) break;
+          if (j == nkeepers) {
+            int sv[2];
+            if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, sv) == -1)
+              break;
+            pid_t pid = fork();
+            if (pid == 0) {
+              close(lfd);
+              for (j = 0; j < npending; j++) close(pending[j].fd);
+              close(sv[0]);
+              for (j = 0; j < nkeepers; j++) close(keepers[j].sock);
+              editorKeep(pc->path, sv[1]);
+            }
+            close(sv[1]);
+            if (pid == -1) {
+              close(sv[0]);
+              break;
+            }
+            keepers = realloc(keepers, sizeof(*keepers) * (nkeepers + 1));
+            keepers[nkeepers].path = strdup(pc->path);
+            keepers[nkeepers].sock = sv[0];
+            nkeepers++;
+          }
+          if (editorSendClient(keepers[j].sock, fd, &pc->hello) == 0) break;
+          // The keeper died, a new one is started for the file
+          close(keepers[j].sock);
+          free(keepers[j].path);
+          keepers[j] = keepers[--nkeepers];
+        }
+      }
+      close(fd);
+      pending[i] = pending[--npending];
+    }
+  }
+}
+
+// Runs as a thin client of the server: the keys go to the server and the
+// screens it draws come back. Returns -1 if there is no server
+int editorConnect(char *filename) {
+  struct sockaddr_un addr;
+  if (editorSocketPath(&addr, 0) == -1 || !editorOwnSocket(addr.sun_path))
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) return -1;
+  // The keys typed go to the server, it must be this user's own
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      !editorPeerIsUser(fd)) {
+    close(fd);
+    return -1;
+  }
+
+  // The server may run in another directory
+  char path[PATH_MAX];
+  if (realpath(filename, path) == NULL) {
+    if (filename[0] == '/' || getcwd(path, sizeof(path)) == NULL)
+      snprintf(path, sizeof(path), "%s", filename);
+    else
+      snprintf(path + strlen(path), sizeof(path) - strlen(path), "/%s",
+               filename);
+  }
+
+  struct clientHello hello;
+  memcpy(hello.magic, MVI_SERVER_MAGIC, sizeof(hello.magic));
+  int rows = 24, cols = 80;
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1 && ws.ws_col != 0) {
+    rows = ws.ws_row;
+    cols = ws.ws_col;
+  }
+  hello.rows = rows;
+  hello.cols = cols;
+  hello.pathlen = strlen(path);
+  if (writeAll(fd, (char *)&hello, sizeof(hello)) == -1 ||
+      writeAll(fd, path, hello.pathlen) == -1) {
+    close(fd);
+    return -1;
+  }
+
+  enableRawMode();
+  struct pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+  char buf[65536];
+  while (1) {
+    if (poll(fds, 2, -1) == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+    if (fds[0].revents & POLLIN) {
+      ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+      if (n > 0 && writeAll(fd, buf, n) == -1) break;
+    }
+    if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0) break;
+      if (writeAll(STDOUT_FILENO, buf, n) == -1) break;
+    }
+  }
+  exit(0);
+}
+
 /*** init ***/
 
 void initEditor() {
@@ -1015,30 +5436,116 @@ void initEditor() {
   E.coloff = 0;
   E.numrows = 0;
   E.row = NULL;
+  E.rowcap = 0;
+  E.rowmap = NULL;
+  E.rowmaplen = 0;
   E.dirty = 0;
+  memset(&E.arena, 0, sizeof(E.arena));
   E.filename = NULL;
   E.statusmsg[0] = '\0';
   E.statusmsg_time = 0;
   E.mode = MODE_NORMAL;
+  E.memlimit = 0;
+  E.rowbytes = 0;
+  E.srcfd = -1;
+  E.spillfd = -1;
+  E.spilllen = 0;
+  E.indexcache = 0;
+  E.dirtylo = INT_MAX;
+  E.dirtyhi = 0;
+  E.clock = 0;
+  E.follow = 0;
+  E.inotifyfd = -1;
+  E.followwd = -1;
+  E.followfd = -1;
+  memset(&E.filestat, 0, sizeof(E.filestat));
+  E.diskchanged = 0;
+  E.undo.spans = NULL;
+  E.undo.nspans = 0;
+  E.undo.cap = 0;
+  E.undo.rows = NULL;
+  E.undo.dirty = -1;
+  memset(&E.diff, 0, sizeof(E.diff));
+  E.diff.disk.fd = -1;
 
-  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
-  E.screenrows -= 2; // So the status bar has 2 rows
+  E.count = 0;
+  E.tabstop = MVI_TAB_STOP;
+  E.recording = -1;
+  memset(E.macros, 0, sizeof(E.macros));
+  memset(E.yanks, 0, sizeof(E.yanks));
+  E.yankreg = -1;
+  E.replaying = 0;
+  E.typeahead = NULL;
+  E.typeaheadlen = 0;
+  E.typeaheadpos = 0;
+  E.session = 0;
+  E.sessions = NULL;
+  memset(&E.hex, 0, sizeof(E.hex));
+  E.hex.fd = -1;
+  memset(&E.words, 0, sizeof(E.words));
+  memset(&E.complete, 0, sizeof(E.complete));
 }
 
 int main(int argc, char *argv[]) {
-  enableRawMode();
-  initEditor();
-  if (argc >= 2) {
-    // Open editor with file name
-    editorOpen(argv[1]);
+  size_t memlimit = 0;
+  int follow = 0, indexcache = 0, serve = 0, client = 0, hex = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "cfim:Sx")) != -1) {
+    switch (opt) {
+      // Show the file in hex even if it looks like text
+      case 'x':
+        hex = 1;
+        break;
+      // Edit the file through the server
+      case 'c':
+        client = 1;
+        break;
+      // Keep files loaded and serve them to clients
+      case 'S':
+        serve = 1;
+        break;
+      // Follow the file as it grows
+      case 'f':
+        follow = 1;
+        break;
+      // Keep a cache of the line offsets to open the file faster next time
+      case 'i':
+        indexcache = 1;
+        break;
+      // Memory budget for the text of the rows, in megabytes. The row
+      // metadata is not counted, it always stays in memory
+      case 'm':
+        memlimit = (size_t)atol(optarg) << 20;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-f] [-i] [-x] [-m text-megabytes] [file]\n"
+                        "       %s -S [-i] [-m text-megabytes]\n"
+                        "       %s -c file\n", argv[0], argv[0], argv[0]);
+        exit(1);
+    }
   }
 
-  editorSetStatusMessage("HELP: i for insert mode | :q to quit | :w to save | :s <token> to search");
+  initEditor();
+  E.memlimit = memlimit;
+  E.indexcache = indexcache;
+  E.hex.forced = hex;
+  if (serve) editorServe();
 
-  while (1) {
-    editorRefreshScreen();
-    editorProcessKeypress();
+  // Without a server the file is edited here
+  if (client && optind < argc) editorConnect(argv[optind]);
+
+  enableRawMode();
+  if (getWindowSize(&E.screenrows, &E.screencols) == -1) die("getWindowSize");
+  E.screenrows -= 2; // So the status bar has 2 rows
+  if (optind < argc) {
+    // Open editor with file name
+    editorOpen(argv[optind]);
+    if (follow && !E.hex.active) editorFollowStart();
   }
 
+  if (E.statusmsg[0] == '\0')
+    editorSetStatusMessage("HELP: i for insert mode | :q to quit | :w to save | :s <token> to search");
+
+  editorLoop();
   return 0;
 }